@@ -1,8 +1,19 @@
 #include <bitset>
 #include <cassert>
+#include <algorithm>
 
 #include "diskinterface.hpp"
 
+constexpr size_t Chunk::ALIGNMENT;
+
+Chunk::Buffer Chunk::allocate_buffer(size_t size_bytes) {
+	void *buffer = nullptr;
+	if (posix_memalign(&buffer, ALIGNMENT, size_bytes) != 0) {
+		throw std::bad_alloc();
+	}
+	return Buffer((Byte *)buffer);
+}
+
 Chunk::~Chunk() {
 	// whenever the last reference to a chunk is released, we flush the chunk
 	// out to the disk 
@@ -12,7 +23,7 @@ Chunk::~Chunk() {
 std::shared_ptr<Chunk> Disk::get_chunk(Size chunk_idx) {
 	std::lock_guard<std::mutex> g(lock); // acquire the lock
 
-	if (chunk_idx > this->size_chunks()) {
+	if (chunk_idx >= this->size_chunks()) {
 		throw DiskException("chunk index out of bounds");
 	}
 	
@@ -25,7 +36,7 @@ std::shared_ptr<Chunk> Disk::get_chunk(Size chunk_idx) {
 	chunk->parent = this; 
 	chunk->size_bytes = this->chunk_size();
 	chunk->chunk_idx = chunk_idx;
-	chunk->data = std::unique_ptr<Byte[]>(new Byte[this->chunk_size()]);
+	chunk->data = Chunk::allocate_buffer(this->chunk_size());
 	std::memcpy(chunk->data.get(), this->data.get() + chunk_idx * this->chunk_size(), 
 		this->chunk_size());
 
@@ -44,6 +55,54 @@ void Disk::flush_chunk(const Chunk& chunk) {
 		chunk.data.get(), this->chunk_size());
 }
 
+void Disk::write_chunks(Size chunk_idx, Size count, const Byte *buf) {
+	// loaded chunks are released only after the lock is dropped, since the 
+	// last reference flushes the chunk which takes the lock again
+	std::vector<std::shared_ptr<Chunk>> loaded;
+	{
+		std::lock_guard<std::mutex> g(lock); // acquire the lock
+
+		if (chunk_idx >= this->size_chunks() || count > this->size_chunks() - chunk_idx) {
+			throw DiskException("chunk index out of bounds");
+		}
+
+		std::memcpy(this->data.get() + chunk_idx * this->chunk_size(), buf, 
+			count * this->chunk_size());
+
+		if (this->chunk_cache.size() == 0)
+			return ;
+		for (Size idx = 0; idx < count; ++idx) {
+			if (auto chunk = this->chunk_cache.get(chunk_idx + idx)) {
+				std::memcpy(chunk->data.get(), buf + idx * this->chunk_size(), this->chunk_size());
+				loaded.push_back(std::move(chunk));
+			}
+		}
+	}
+}
+
+void Disk::read_chunks(Size chunk_idx, Size count, Byte *buf) {
+	std::vector<std::shared_ptr<Chunk>> loaded;
+	{
+		std::lock_guard<std::mutex> g(lock); // acquire the lock
+
+		if (chunk_idx >= this->size_chunks() || count > this->size_chunks() - chunk_idx) {
+			throw DiskException("chunk index out of bounds");
+		}
+
+		std::memcpy(buf, this->data.get() + chunk_idx * this->chunk_size(), 
+			count * this->chunk_size());
+
+		if (this->chunk_cache.size() == 0)
+			return ;
+		for (Size idx = 0; idx < count; ++idx) {
+			if (auto chunk = this->chunk_cache.get(chunk_idx + idx)) {
+				std::memcpy(buf + idx * this->chunk_size(), chunk->data.get(), this->chunk_size());
+				loaded.push_back(std::move(chunk));
+			}
+		}
+	}
+}
+
 void Disk::try_close() {
 	std::lock_guard<std::mutex> g(lock); // acquire the lock
 	this->chunk_cache.sweep(true);
@@ -79,12 +138,42 @@ static bool bitmap_init_cache(std::array<DiskBitMap::BitRange, 256>& cache) {
 
 static bool find_unset_cache_initialized = bitmap_init_cache(DiskBitMap::find_unset_cache);
 
-DiskBitMap::BitRange DiskBitMap::find_unset_bits(Size length) const {
+DiskBitMap::BitRange DiskBitMap::find_unset_bits(Size length, uint64_t &hint, Size start_idx, Size end_idx) const {
+	using BitRange = DiskBitMap::BitRange;
+
+	if (end_idx > this->size_in_bits) {
+		end_idx = this->size_in_bits;
+	}
+
+	const uint64_t first_byte = start_idx / 8;
+	const uint64_t end_byte = (end_idx + 7) / 8;
+	const uint64_t start_byte = hint >= first_byte && hint < end_byte ? hint : first_byte;
+
+	// search from the cursor to the end of the range, then wrap around to the front
+	BitRange retval = this->scan_unset_bits(start_byte * 8, end_idx, end_idx, length);
+	if (retval.bit_count == 0 && start_byte != first_byte) {
+		retval = this->scan_unset_bits(first_byte * 8, start_byte * 8, end_idx, length);
+	}
+
+	if (retval.bit_count != 0) {
+		hint = (retval.start_idx + retval.bit_count) / 8;
+	}
+
+	return retval;
+}
+
+// scans bytes beginning in [start_idx, end_idx) for a run of unset bits, a run 
+// that is already in progress is allowed to extend past end_idx up to limit_idx
+DiskBitMap::BitRange DiskBitMap::scan_unset_bits(Size start_idx, Size end_idx, Size limit_idx, Size length) const {
 	using BitRange = DiskBitMap::BitRange;
 	
 	BitRange retval;
-	for (Size idx = 0; idx < this->size_in_bits; idx += 8) {
-		const size_t byte = (size_t)this->get_byte_for_idx(idx);
+	for (Size idx = start_idx; idx < limit_idx; idx += 8) {
+		if (idx >= end_idx && retval.bit_count == 0) {
+			break ;
+		}
+
+		const size_t byte = (size_t)this->load_byte_for_idx(idx);
 		BitRange res = find_unset_cache[byte];
 		res.start_idx += idx;
 
@@ -106,10 +195,443 @@ DiskBitMap::BitRange DiskBitMap::find_unset_bits(Size length) const {
 		}
 	}
 
-	// bitcount should be limited to the length requested
+	// bitcount should be limited to the length requested and to the range searched
 	if (retval.bit_count > length) {
 		retval.bit_count = length;
 	}
+	if (retval.start_idx >= limit_idx) {
+		retval = BitRange();
+	} else if (retval.start_idx + retval.bit_count > limit_idx) {
+		retval.bit_count = limit_idx - retval.start_idx;
+	}
+
+	return retval;
+}
+
+
+std::vector<std::unique_lock<std::mutex>> DiskBitMap::lock_range(Size start_idx, Size count) {
+	std::vector<std::unique_lock<std::mutex>> locks;
+	if (count == 0) {
+		return locks;
+	}
+
+	const Size bits_per_chunk = disk->chunk_size() * 8;
+	const Size last_chunk = std::min((start_idx + count - 1) / bits_per_chunk, (Size)this->chunks.size() - 1);
+	for (Size chunk = start_idx / bits_per_chunk; chunk <= last_chunk; ++chunk) {
+		locks.push_back(std::unique_lock<std::mutex>(this->chunks[chunk]->lock));
+	}
+	return locks;
+}
+
+bool DiskBitMap::atomic_get(Size idx) const {
+	const Byte byte = this->load_byte<__ATOMIC_ACQUIRE>(idx);
+	return byte & (1 << (idx % 8));
+}
+
+bool DiskBitMap::atomic_set(Size idx) {
+	const bool was_set = this->update_bit<__ATOMIC_ACQ_REL>(idx, true);
+	if (!was_set && idx < this->size_in_bits) {
+		this->set_count++;
+	}
+	return was_set;
+}
+
+bool DiskBitMap::atomic_clr(Size idx) {
+	const bool was_set = this->update_bit<__ATOMIC_ACQ_REL>(idx, false);
+	if (was_set && idx < this->size_in_bits) {
+		this->set_count--;
+	}
+	return was_set;
+}
+
+uint64_t DiskBitMap::count_set_bits(Size end_idx) const {
+	if (end_idx > this->size_in_bits) {
+		end_idx = this->size_in_bits;
+	}
+
+	uint64_t count = 0;
+	for (Size idx = 0; idx < end_idx; idx += 8) {
+		Byte byte = this->load_byte_for_idx(idx);
+		if (end_idx - idx < 8) {
+			// ignore the padding after the last bit
+			byte &= (1 << (end_idx - idx)) - 1;
+		}
+		count += __builtin_popcount(byte);
+	}
+	return count;
+}
+
+bool DiskBitMap::claim_unset_bit(Size &claimed_idx, uint64_t &hint, Size start_idx, Size end_idx) {
+	if (end_idx > this->size_in_bits) {
+		end_idx = this->size_in_bits;
+	}
+	if (start_idx >= end_idx) {
+		return false;
+	}
+
+	const Size word_bits = this->word_access() ? 64 : 8;
+	const Size first_word = start_idx / word_bits;
+	const Size end_word = (end_idx + word_bits - 1) / word_bits;
+	Size hint_word = hint * 8 / word_bits;
+	if (hint_word < first_word || hint_word >= end_word) {
+		hint_word = first_word;
+	}
+
+	// search from the cursor to the end of the range, then wrap around to the front
+	bool claimed = false;
+	if (word_bits == 64) {
+		claimed = this->claim_in_words<uint64_t>(claimed_idx, hint_word, end_word, start_idx, end_idx) ||
+			this->claim_in_words<uint64_t>(claimed_idx, first_word, hint_word, start_idx, end_idx);
+	} else {
+		claimed = this->claim_in_words<Byte>(claimed_idx, hint_word, end_word, start_idx, end_idx) ||
+			this->claim_in_words<Byte>(claimed_idx, first_word, hint_word, start_idx, end_idx);
+	}
+
+	if (claimed) {
+		hint = (claimed_idx + 1) / 8;
+		this->set_count++;
+	}
+	return claimed;
+}
+
+template<typename Word>
+bool DiskBitMap::claim_in_words(Size &claimed_idx, Size first_word, Size end_word, Size start_idx, Size end_idx) {
+	constexpr Size WORD_BITS = sizeof(Word) * 8;
+
+	for (Size word_idx = first_word; word_idx < end_word; ++word_idx) {
+		// only bits inside [start_idx, end_idx) may be claimed
+		const Size lo = std::max(start_idx, word_idx * WORD_BITS) - word_idx * WORD_BITS;
+		const Size hi = std::min(end_idx, (word_idx + 1) * WORD_BITS) - word_idx * WORD_BITS;
+		const Word hi_mask = hi == WORD_BITS ? (Word)~(Word)0 : (Word)(((Word)1 << hi) - 1);
+		const Word mask = hi_mask & (Word)~(Word)(((Word)1 << lo) - 1);
+
+		Word *word = this->word_for_idx<Word>(word_idx * WORD_BITS);
+		Word value = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+		while (true) {
+			const Word avail = (Word)~value & mask;
+			if (avail == 0) {
+				break ;
+			}
+
+			const Size bit = __builtin_ctzll((unsigned long long)avail);
+			// on failure value is reloaded with the word's current contents
+			if (__atomic_compare_exchange_n(word, &value, (Word)(value | ((Word)1 << bit)), 
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				claimed_idx = word_idx * WORD_BITS + bit;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void FreeExtentTree::build(const DiskBitMap &map, Size start_idx, Size end_idx) {
+	this->clear();
+
+	Size run_start = 0;
+	Size run_length = 0;
+	for (Size idx = start_idx; idx < end_idx;) {
+		// whole bytes can be skipped or accepted without looking at every bit
+		if (idx % 8 == 0 && idx + 8 <= end_idx) {
+			const Byte byte = map.load_byte_for_idx(idx);
+			if (byte == 0xFF) {
+				if (run_length != 0) {
+					this->add_extent(run_start, run_length);
+					run_length = 0;
+				}
+				idx += 8;
+				continue ;
+			} else if (byte == 0) {
+				if (run_length == 0) {
+					run_start = idx;
+				}
+				run_length += 8;
+				idx += 8;
+				continue ;
+			}
+		}
+
+		if (!map.get(idx)) {
+			if (run_length == 0) {
+				run_start = idx;
+			}
+			run_length++;
+		} else if (run_length != 0) {
+			this->add_extent(run_start, run_length);
+			run_length = 0;
+		}
+		idx++;
+	}
+
+	if (run_length != 0) {
+		this->add_extent(run_start, run_length);
+	}
+}
+
+void FreeExtentTree::clear() {
+	this->root = nullptr;
+	this->by_length.clear();
+	this->_free_count = 0;
+}
+
+void FreeExtentTree::insert(Size start_idx, Size count) {
+	if (count == 0) 
+		return ;
+
+	// coalesce with the extent that ends where this one starts
+	const Node *prev = start_idx == 0 ? nullptr : this->floor_node(start_idx - 1);
+	if (prev != nullptr && prev->start_idx + prev->bit_count > start_idx) {
+		throw DiskException("freeing an extent which overlaps a free extent");
+	}
+	if (prev != nullptr && prev->start_idx + prev->bit_count == start_idx) {
+		const Size prev_start = prev->start_idx;
+		const Size prev_count = prev->bit_count;
+		this->erase_extent(prev_start, prev_count);
+		start_idx = prev_start;
+		count += prev_count;
+	}
+
+	// and with the extent that starts where this one ends
+	const Node *next = this->ceil_node(start_idx);
+	if (next != nullptr && next->start_idx < start_idx + count) {
+		throw DiskException("freeing an extent which overlaps a free extent");
+	}
+	if (next != nullptr && next->start_idx == start_idx + count) {
+		const Size next_count = next->bit_count;
+		this->erase_extent(next->start_idx, next_count);
+		count += next_count;
+	}
+
+	this->add_extent(start_idx, count);
+}
+
+void FreeExtentTree::remove(Size start_idx, Size count) {
+	if (count == 0) 
+		return ;
+
+	const Node *node = this->floor_node(start_idx);
+	if (node == nullptr || node->start_idx + node->bit_count < start_idx + count) {
+		throw DiskException("removing an extent which is not free");
+	}
+
+	const Size ext_start = node->start_idx;
+	const Size ext_count = node->bit_count;
+	this->erase_extent(ext_start, ext_count);
+
+	if (ext_start < start_idx) {
+		this->add_extent(ext_start, start_idx - ext_start);
+	}
+	if (start_idx + count < ext_start + ext_count) {
+		this->add_extent(start_idx + count, ext_start + ext_count - start_idx - count);
+	}
+}
+
+FreeExtentTree::Extent FreeExtentTree::containing(Size idx) const {
+	Extent retval;
+	const Node *node = this->floor_node(idx);
+	if (node != nullptr && node->start_idx + node->bit_count > idx) {
+		retval.start_idx = node->start_idx;
+		retval.bit_count = node->bit_count;
+	}
+	return retval;
+}
+
+FreeExtentTree::Extent FreeExtentTree::first_fit(Size length) const {
+	Extent retval;
+	if (const Node *node = first_fit_node(this->root.get(), 0, length)) {
+		retval.start_idx = node->start_idx;
+		retval.bit_count = length;
+	}
+	return retval;
+}
 
+FreeExtentTree::Extent FreeExtentTree::best_fit(Size length) const {
+	Extent retval;
+	auto it = this->by_length.lower_bound(std::make_pair(length, (Size)0));
+	if (it != this->by_length.end()) {
+		retval.start_idx = it->second;
+		retval.bit_count = length;
+	}
 	return retval;
-}
\ No newline at end of file
+}
+
+FreeExtentTree::Extent FreeExtentTree::near_fit(Size length, Size goal) const {
+	Extent retval;
+
+	// if goal itself is free and the extent has room after it, take it exactly
+	const Node *node = this->floor_node(goal);
+	if (node != nullptr && node->start_idx + node->bit_count >= goal + length) {
+		retval.start_idx = goal;
+		retval.bit_count = length;
+		return retval;
+	}
+
+	// otherwise take the closer of the nearest fits after and before goal, 
+	// preferring to allocate forwards when the distances are equal
+	const Node *after = first_fit_node(this->root.get(), goal, length);
+	const Node *before = last_fit_node(this->root.get(), goal, length);
+	if (after == nullptr && before == nullptr) {
+		return retval;
+	}
+
+	retval.bit_count = length;
+	if (before == nullptr) {
+		retval.start_idx = after->start_idx;
+	} else {
+		// allocate from the end of the earlier extent, the side nearest to goal
+		const Size before_start = before->start_idx + before->bit_count - length;
+		if (after != nullptr && after->start_idx - goal <= goal - before_start) {
+			retval.start_idx = after->start_idx;
+		} else {
+			retval.start_idx = before_start;
+		}
+	}
+
+	return retval;
+}
+
+FreeExtentTree::Extent FreeExtentTree::largest() const {
+	Extent retval;
+	if (!this->by_length.empty()) {
+		auto it = this->by_length.rbegin();
+		retval.start_idx = it->second;
+		retval.bit_count = it->first;
+	}
+	return retval;
+}
+
+void FreeExtentTree::add_extent(Size start_idx, Size count) {
+	// xorshift for treap priorities
+	this->seed ^= this->seed << 13;
+	this->seed ^= this->seed >> 17;
+	this->seed ^= this->seed << 5;
+
+	std::unique_ptr<Node> node(new Node);
+	node->start_idx = start_idx;
+	node->bit_count = count;
+	node->max_bit_count = count;
+	node->priority = this->seed;
+
+	std::unique_ptr<Node> left, right;
+	split(std::move(this->root), start_idx, left, right);
+	this->root = merge(merge(std::move(left), std::move(node)), std::move(right));
+
+	this->by_length.insert(std::make_pair(count, start_idx));
+	this->_free_count += count;
+}
+
+void FreeExtentTree::erase_extent(Size start_idx, Size count) {
+	std::unique_ptr<Node> left, mid, right;
+	split(std::move(this->root), start_idx, left, mid);
+	split(std::move(mid), start_idx + 1, mid, right);
+	this->root = merge(std::move(left), std::move(right));
+
+	this->by_length.erase(std::make_pair(count, start_idx));
+	this->_free_count -= count;
+}
+
+// the extent with the greatest start_idx <= idx
+const FreeExtentTree::Node *FreeExtentTree::floor_node(Size idx) const {
+	const Node *retval = nullptr;
+	const Node *node = this->root.get();
+	while (node != nullptr) {
+		if (node->start_idx <= idx) {
+			retval = node;
+			node = node->right.get();
+		} else {
+			node = node->left.get();
+		}
+	}
+	return retval;
+}
+
+// the extent with the smallest start_idx >= idx
+const FreeExtentTree::Node *FreeExtentTree::ceil_node(Size idx) const {
+	const Node *retval = nullptr;
+	const Node *node = this->root.get();
+	while (node != nullptr) {
+		if (node->start_idx >= idx) {
+			retval = node;
+			node = node->left.get();
+		} else {
+			node = node->right.get();
+		}
+	}
+	return retval;
+}
+
+// the extent with the smallest start_idx >= from_idx that is at least length long
+const FreeExtentTree::Node *FreeExtentTree::first_fit_node(const Node *node, Size from_idx, Size length) {
+	if (node == nullptr || node->max_bit_count < length) 
+		return nullptr;
+
+	if (node->start_idx < from_idx) 
+		return first_fit_node(node->right.get(), from_idx, length);
+
+	if (const Node *retval = first_fit_node(node->left.get(), from_idx, length)) 
+		return retval;
+	if (node->bit_count >= length) 
+		return node;
+	return first_fit_node(node->right.get(), from_idx, length);
+}
+
+// the extent with the greatest start_idx < before_idx that is at least length long
+const FreeExtentTree::Node *FreeExtentTree::last_fit_node(const Node *node, Size before_idx, Size length) {
+	if (node == nullptr || node->max_bit_count < length) 
+		return nullptr;
+
+	if (node->start_idx >= before_idx) 
+		return last_fit_node(node->left.get(), before_idx, length);
+
+	if (const Node *retval = last_fit_node(node->right.get(), before_idx, length)) 
+		return retval;
+	if (node->bit_count >= length) 
+		return node;
+	return last_fit_node(node->left.get(), before_idx, length);
+}
+
+void FreeExtentTree::update(Node *node) {
+	node->max_bit_count = node->bit_count;
+	if (node->left && node->left->max_bit_count > node->max_bit_count) 
+		node->max_bit_count = node->left->max_bit_count;
+	if (node->right && node->right->max_bit_count > node->max_bit_count) 
+		node->max_bit_count = node->right->max_bit_count;
+}
+
+// splits node into the extents starting before key and those starting at or after it
+void FreeExtentTree::split(std::unique_ptr<Node> node, Size key, 
+	std::unique_ptr<Node> &left, std::unique_ptr<Node> &right) {
+	if (!node) {
+		left = nullptr;
+		right = nullptr;
+		return ;
+	}
+
+	if (node->start_idx < key) {
+		split(std::move(node->right), key, node->right, right);
+		update(node.get());
+		left = std::move(node);
+	} else {
+		split(std::move(node->left), key, left, node->left);
+		update(node.get());
+		right = std::move(node);
+	}
+}
+
+std::unique_ptr<FreeExtentTree::Node> FreeExtentTree::merge(std::unique_ptr<Node> left, std::unique_ptr<Node> right) {
+	if (!left) 
+		return right;
+	if (!right) 
+		return left;
+
+	if (left->priority > right->priority) {
+		left->right = merge(std::move(left->right), std::move(right));
+		update(left.get());
+		return left;
+	} else {
+		right->left = merge(std::move(left), std::move(right->left));
+		update(right.get());
+		return right;
+	}
+}
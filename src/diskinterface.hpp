@@ -3,13 +3,16 @@
 
 #include <stdint.h>
 #include <mutex>
+#include <atomic>
 #include <unordered_map>
 #include <string>
 #include <vector>
 #include <array>
+#include <set>
 #include <iostream>
 
 #include <cstring>
+#include <cstdlib>
 #include <memory>
 
 typedef uint8_t Byte;
@@ -23,12 +26,23 @@ struct DiskException : public std::exception {
 };
 
 struct Chunk {
+	// chunk buffers start on a cache line, so that records laid out in 
+	// multiples of it (inodes, say) never straddle two
+	static constexpr size_t ALIGNMENT = 64;
+	struct FreeBuffer {
+		void operator()(Byte *buffer) const {
+			std::free(buffer);
+		}
+	};
+	using Buffer = std::unique_ptr<Byte[], FreeBuffer>;
+	static Buffer allocate_buffer(size_t size_bytes);
+
 	Disk *parent = nullptr;
 
 	std::mutex lock;
 	size_t size_bytes = 0;
 	size_t chunk_idx = 0;
-	std::unique_ptr<Byte[]> data = nullptr;
+	Buffer data = nullptr;
 
 	~Chunk();
 };
@@ -71,6 +85,20 @@ public:
 		return nullptr;
 	}
 
+	void erase(const K& k) {
+		map.erase(k);
+	}
+
+	// calls f(key, object) for every object that is still alive
+	template<typename F>
+	void for_each(F f) {
+		for (auto it = this->map.begin(); it != this->map.end(); ++it) {
+			if (std::shared_ptr<V> v = (*it).second.lock()) {
+				f((*it).first, v);
+			}
+		}
+	}
+
 	inline size_t size() {
 		return this->map.size();
 	}
@@ -123,6 +151,15 @@ public:
 
 	void flush_chunk(const Chunk& chunk);
 
+	// overwrites count whole chunks starting at chunk_idx with buf in one copy, 
+	// without loading them. chunks that are currently loaded are updated as well
+	void write_chunks(Size chunk_idx, Size count, const Byte *buf);
+
+	// copies count whole chunks starting at chunk_idx into buf without loading 
+	// them. chunks that are currently loaded may be ahead of the disk, they are 
+	// copied from memory instead
+	void read_chunks(Size chunk_idx, Size count, Byte *buf);
+
 	void try_close();
 
 	~Disk();
@@ -130,56 +167,62 @@ public:
 
 /*
 	A utility class that implements a bitmap ontop of a range of chunks
+
+	single bit operations are atomic and take no locks, so any number of threads
+	may share a map. operations spanning several bits (ranges, clearing, counting)
+	lock the chunks they cover for just their own duration, in ascending order
 */
 struct DiskBitMap {
-	std::mutex block;
-
 	Disk *disk;
 	Size size_in_bits;
 	std::vector<std::shared_ptr<Chunk>> chunks;
 
-	DiskBitMap(Disk *disk, Size chunk_start, Size size_in_bits) {
+	// number of set bits, kept up to date by every operation that flips a bit so 
+	// that asking how full the map is never needs a scan. it starts at 0 when 
+	// attaching to an existing map, the owner restores it (see count_set_bits)
+	std::atomic<uint64_t> set_count;
+
+	DiskBitMap(Disk *disk, Size chunk_start, Size size_in_bits) : set_count(0), find_last_byte_idx(0) {
 		this->size_in_bits = size_in_bits;
 		this->disk = disk;
 		for (uint64_t idx = 0; idx < this->size_chunks(); ++idx) {
-			auto chunk = disk->get_chunk(idx + chunk_start);
-			chunk->lock.lock();
-			this->chunks.push_back(std::move(chunk));
-		}
-	}
-
-	~DiskBitMap() {
-		for (auto &chunk : chunks) {
-			chunk->lock.unlock();
+			this->chunks.push_back(disk->get_chunk(idx + chunk_start));
 		}
 	}
 
 	void clear_all() {
-		std::cout << "\tIN CLEAR ALL" << std::endl;
 		for (std::shared_ptr<Chunk>& chunk : chunks) {
-			std::cout << "\t\ttrying to clear a chunk" << std::endl;
-			std::cout << "\t\tclearing chunk: " << chunk->chunk_idx << "/" << this->chunks.size() << std::endl;
-			std::cout << "\t\t\tchunk size in bytes is: " << chunk->size_bytes << std::endl;
-			std::cout << "\t\t\tchunk data address is:" << (unsigned long long)chunk->data.get() << std::endl;
+			std::lock_guard<std::mutex> g(chunk->lock);
 			std::memset(chunk->data.get(), 0, chunk->size_bytes);
 		}
 
-		std::cout << "\tDONE, NOW SETTING BITMAP VALUES" << std::endl;
-
+		this->set_count = 0;
 		for (uint64_t idx = this->size_in_bits; idx < this->size_in_bits + 8; ++idx) {
 			this->set(idx);
 		}
 
-		std::cout << "\tOUT CLEAR ALL" << std::endl;
+		this->find_last_byte_idx = 0;
 	}
 
-	Size size_bytes() const {
+	// locks the chunks holding bits [start_idx, start_idx + count) in ascending 
+	// order. must not be called by a thread that already holds any of them
+	std::vector<std::unique_lock<std::mutex>> lock_range(Size start_idx, Size count);
+
+	static Size size_bytes_for(Size size_in_bits) {
 		// add an extra byte which will be used for padding
 		return size_in_bits / 8 + 2;
 	}
 
+	static Size size_chunks_for(Size chunk_size, Size size_in_bits) {
+		return size_bytes_for(size_in_bits) / chunk_size + 1;
+	}
+
+	Size size_bytes() const {
+		return size_bytes_for(this->size_in_bits);
+	}
+
 	Size size_chunks() const {
-		return this->size_bytes() / disk->chunk_size() + 1;
+		return size_chunks_for(disk->chunk_size(), this->size_in_bits);
 	}
 
 	inline Byte &get_byte_for_idx(Size idx) {
@@ -194,32 +237,62 @@ struct DiskBitMap {
 		return data[byte_idx % disk->chunk_size()];
 	}
 
+	// bytes may be modified by other threads at any time, so they are read atomically
+	inline Byte load_byte_for_idx(Size idx) const {
+		return load_byte<__ATOMIC_RELAXED>(idx);
+	}
+
 	inline bool get(Size idx) const {
-		Byte byte = get_byte_for_idx(idx);
+		Byte byte = load_byte_for_idx(idx);
 		return byte & (1 << (idx % 8));
 	}
 
 	inline void set(Size idx) {
-		Byte& byte = get_byte_for_idx(idx);
-		byte |= (1 << (idx % 8));
+		if (!update_bit<__ATOMIC_RELAXED>(idx, true) && idx < this->size_in_bits) {
+			this->set_count++;
+		}
 	}
 
 	inline void clr(Size idx) {
-		Byte& byte = get_byte_for_idx(idx);
-		byte &= ~(1 << (idx % 8));
+		if (update_bit<__ATOMIC_RELAXED>(idx, false) && idx < this->size_in_bits) {
+			this->set_count--;
+		}
+	}
+
+	inline uint64_t unset_count() const {
+		return this->size_in_bits - this->set_count.load();
+	}
+
+	// counts the set bits by scanning the whole map
+	uint64_t count_set_bits() const {
+		return this->count_set_bits(this->size_in_bits);
 	}
+	// counts only the bits before end_idx
+	uint64_t count_set_bits(Size end_idx) const;
+
+	// variants of get, set and clr with acquire/release ordering, set and clr 
+	// return the previous value of the bit
+	bool atomic_get(Size idx) const;
+	bool atomic_set(Size idx);
+	bool atomic_clr(Size idx);
+
+	// atomically claims (sets) the first unset bit in [start_idx, end_idx) at or 
+	// after the cursor, wrapping around. returns false if every bit is set
+	bool claim_unset_bit(Size &claimed_idx, uint64_t &hint, Size start_idx, Size end_idx);
 
 	struct BitRange {
 		Size start_idx = 0;
 		Size bit_count = 0;
 
 		void set_range(DiskBitMap &map) {
+			auto locks = map.lock_range(start_idx, bit_count);
 			for (Size idx = start_idx; idx < start_idx + bit_count; ++idx) {
 				map.set(idx);
 			}
 		}
 
 		void clr_range(DiskBitMap &map) {
+			auto locks = map.lock_range(start_idx, bit_count);
 			for (Size idx = start_idx; idx < start_idx + bit_count; ++idx) {
 				map.clr(idx);
 			}
@@ -227,10 +300,144 @@ struct DiskBitMap {
 	};
 
 	static std::array<BitRange, 256> find_unset_cache;
-	static uint64_t find_last_byte_idx;
+
+	// next-fit allocation cursor: the byte at which the last successful search
+	// ended. searches resume here and wrap around, so the densely used front
+	// of the map is not rescanned on every allocation
+	mutable std::atomic<uint64_t> find_last_byte_idx;
 	
-	BitRange find_unset_bits(Size length) const;
+	// finds the first run of unset bits at or after the bitmap's cursor. the bits
+	// are not claimed, with several threads use claim_unset_bit or lock_range
+	BitRange find_unset_bits(Size length) const {
+		uint64_t hint = this->find_last_byte_idx.load(std::memory_order_relaxed);
+		BitRange retval = this->find_unset_bits(length, hint);
+		this->find_last_byte_idx.store(hint, std::memory_order_relaxed);
+		return retval;
+	}
+
+	// same as above but with a caller owned cursor (i.e. one per thread)
+	BitRange find_unset_bits(Size length, uint64_t &hint) const {
+		return this->find_unset_bits(length, hint, 0, this->size_in_bits);
+	}
+
+	// same as above but only bits in [start_idx, end_idx) are considered, both 
+	// ends must fall on a byte boundary (or the end of the map)
+	BitRange find_unset_bits(Size length, uint64_t &hint, Size start_idx, Size end_idx) const;
+
+private:
+	BitRange scan_unset_bits(Size start_idx, Size end_idx, Size limit_idx, Size length) const;
+
+	// atomics work on 64 bit words when no word straddles two chunks. every 
+	// access to the bits goes through a word then, plain and atomic alike, so 
+	// the same memory is never accessed with two different sizes
+	inline bool word_access() const {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		return disk->chunk_size() % sizeof(uint64_t) == 0;
+#else
+		return false;
+#endif
+	}
+
+	template<typename Word> Word *word_for_idx(Size idx) const {
+		const uint64_t byte_idx = idx / (8 * sizeof(Word)) * sizeof(Word);
+		Byte *data = this->chunks[byte_idx / disk->chunk_size()]->data.get();
+		return (Word *)(data + byte_idx % disk->chunk_size());
+	}
+
+	template<int MemOrder> Byte load_byte(Size idx) const {
+		if (word_access()) {
+			const uint64_t word = __atomic_load_n(word_for_idx<uint64_t>(idx), MemOrder);
+			return (Byte)(word >> (idx / 8 % sizeof(uint64_t) * 8));
+		}
+		return __atomic_load_n(&get_byte_for_idx(idx), MemOrder);
+	}
+
+	// sets or clears the bit, returns its previous value
+	template<int MemOrder> bool update_bit(Size idx, bool value) {
+		if (word_access()) {
+			const uint64_t mask = 1ull << (idx % 64);
+			uint64_t *word = word_for_idx<uint64_t>(idx);
+			const uint64_t old = value ? __atomic_fetch_or(word, mask, MemOrder) : __atomic_fetch_and(word, ~mask, MemOrder);
+			return old & mask;
+		}
+		const Byte mask = 1 << (idx % 8);
+		Byte *byte = &get_byte_for_idx(idx);
+		const Byte old = value ? __atomic_fetch_or(byte, mask, MemOrder) : __atomic_fetch_and(byte, (Byte)~mask, MemOrder);
+		return old & mask;
+	}
+	template<typename Word> bool claim_in_words(Size &claimed_idx, Size first_word, Size end_word, 
+		Size start_idx, Size end_idx);
 };
 
+/*
+	An in-memory index of the free extents of a DiskBitMap. extents are kept in
+	a treap ordered by start (augmented with the largest length in each subtree)
+	and in a set ordered by length, so first-fit, best-fit and near-goal
+	searches are all logarithmic in the number of free extents
+*/
+struct FreeExtentTree {
+	using Extent = DiskBitMap::BitRange;
+
+	FreeExtentTree() = default;
+	FreeExtentTree(const FreeExtentTree&) = delete;
+	FreeExtentTree& operator=(const FreeExtentTree&) = delete;
+
+	// rebuilds the index from the unset bits of map in [start_idx, end_idx)
+	void build(const DiskBitMap &map, Size start_idx, Size end_idx);
+	void clear();
+
+	// marks [start_idx, start_idx + count) free, merging it with its neighbours
+	void insert(Size start_idx, Size count);
+	// marks [start_idx, start_idx + count) used, the range must be free
+	void remove(Size start_idx, Size count);
+
+	// the free extent containing idx, bit_count is 0 if idx is not free
+	Extent containing(Size idx) const;
+
+	// each of these returns an extent of exactly length bits (without removing
+	// it from the index), or an extent with bit_count 0 if there is none
+	Extent first_fit(Size length) const; // lowest address
+	Extent best_fit(Size length) const; // smallest free extent that fits
+	Extent near_fit(Size length, Size goal) const; // as close to goal as possible
+
+	// the largest free extent (not trimmed)
+	Extent largest() const;
+
+	inline Size free_count() const {
+		return this->_free_count;
+	}
+
+	inline size_t extent_count() const {
+		return this->by_length.size();
+	}
+
+private:
+	struct Node {
+		Size start_idx;
+		Size bit_count;
+		Size max_bit_count; // largest bit_count in this subtree
+		uint32_t priority;
+		std::unique_ptr<Node> left;
+		std::unique_ptr<Node> right;
+	};
+
+	std::unique_ptr<Node> root;
+	std::set<std::pair<Size, Size>> by_length; // (bit_count, start_idx)
+	Size _free_count = 0;
+	uint32_t seed = 0x9e3779b9;
+
+	void add_extent(Size start_idx, Size count);
+	void erase_extent(Size start_idx, Size count);
+
+	const Node *floor_node(Size idx) const;
+	const Node *ceil_node(Size idx) const;
+	static const Node *first_fit_node(const Node *node, Size from_idx, Size length);
+	static const Node *last_fit_node(const Node *node, Size before_idx, Size length);
+
+	static void update(Node *node);
+	static void split(std::unique_ptr<Node> node, Size key, 
+		std::unique_ptr<Node> &left, std::unique_ptr<Node> &right);
+	static std::unique_ptr<Node> merge(std::unique_ptr<Node> left, std::unique_ptr<Node> right);
+};
 
 #endif
@@ -2,6 +2,10 @@
 #include <array>
 #include <vector>
 #include <memory>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <ctime>
 
 #include "diskinterface.hpp"
 #include "filesystem.hpp"
@@ -10,189 +14,1492 @@
 using Size = uint64_t;
 
 const uint64_t INode::INDIRECT_TABLE_SIZES[4] = {DIRECT_ADDRESS_COUNT, INDIRECT_ADDRESS_COUNT, DOUBLE_INDIRECT_ADDRESS_COUNT, TRIPPLE_INDIRECT_ADDRESS_COUNT};
+constexpr uint64_t INode::DIRECT_ADDRESS_COUNT;
+constexpr size_t INode::MAPPING_CACHE_LEAVES;
+constexpr uint64_t INode::ZERO_SPAN_SIZE;
+constexpr size_t INodeTable::RECENT_INODES;
+constexpr uint64_t INodeTable::NO_PARENT;
+constexpr uint64_t INodeTable::EXTENSION_CHUNKS;
+constexpr size_t INode::INodeData::RECORD_SIZE;
+
+static_assert(INode::INodeData::RECORD_ADDRESSES + sizeof(INode::INodeData::addresses) == INode::INodeData::RECORD_SIZE, 
+    "the addresses must end the inode record");
+static_assert(INode::INodeData::RECORD_SIZE % Chunk::ALIGNMENT == 0 && INode::INodeData::RECORD_ADDRESSES <= Chunk::ALIGNMENT, 
+    "the fields stat reads must fit in one cache line of the chunk");
+
+void INode::INodeData::encode(Byte *record) const {
+    const uint32_t bits = (uint32_t)inode_bits.to_ulong();
+    const uint32_t reserved = 0;
+    std::memcpy(record + RECORD_FILE_SIZE, &file_size, sizeof(file_size));
+    std::memcpy(record + RECORD_LAST_MODIFIED, &last_modified, sizeof(last_modified));
+    std::memcpy(record + RECORD_UID, &UID, sizeof(UID));
+    std::memcpy(record + RECORD_REFERENCE_COUNT, &reference_count, sizeof(reference_count));
+    std::memcpy(record + RECORD_INODE_BITS, &bits, sizeof(bits));
+    std::memcpy(record + RECORD_INODE_BITS + sizeof(bits), &reserved, sizeof(reserved));
+    std::memcpy(record + RECORD_ADDRESSES, addresses, sizeof(addresses));
+}
+
+void INode::INodeData::decode(const Byte *record) {
+    uint32_t bits = 0;
+    std::memcpy(&file_size, record + RECORD_FILE_SIZE, sizeof(file_size));
+    std::memcpy(&last_modified, record + RECORD_LAST_MODIFIED, sizeof(last_modified));
+    std::memcpy(&UID, record + RECORD_UID, sizeof(UID));
+    std::memcpy(&reference_count, record + RECORD_REFERENCE_COUNT, sizeof(reference_count));
+    std::memcpy(&bits, record + RECORD_INODE_BITS, sizeof(bits));
+    std::memcpy(addresses, record + RECORD_ADDRESSES, sizeof(addresses));
+    inode_bits = std::bitset<13>(bits);
+}
+
+INode::~INode() {
+    if (superblock != nullptr && delalloc_reserved != 0) 
+        superblock->release_chunks(delalloc_reserved);
+}
 
 uint64_t INode::read(uint64_t starting_offset, char *buf, uint64_t n) {
-	uint64_t chunk_number; //index of chunk
-	uint64_t byte_offset; //index of byte within that chunk
-	uint64_t starting_offset_chunk; //starting byte offset of chunk
-	uint64_t ending_offset_chunk; //ending byte offset of chunk
-	uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
-	uint64_t num_bytes_till_end_of_chunk; //including byte_offset
-	uint64_t num_of_chunks_to_access; //number of chunks to access
-	uint64_t i; //loop counter
-	uint64_t bytes_to_read;
-	uint64_t n_copy;
-    uint64_t bytes_to_read_in_first_iteration;
-	std::shared_ptr<Chunk> chunk = nullptr;
-
-	if((starting_offset + n) > data.file_size){
-		n = data.file_size - starting_offset;
-	}
-	n_copy = n;
-
-	//setup info for first chunk
-	chunk_number = starting_offset / superblock->disk_chunk_size;
-	byte_offset = starting_offset % superblock->disk_chunk_size;
-	starting_offset_chunk = chunk_number * superblock->disk_chunk_size;
-	ending_offset_chunk = starting_offset_chunk + superblock->disk_chunk_size - 1;
-	num_bytes_till_end_of_chunk = superblock->disk_chunk_size - byte_offset;
-
-	//find number of chunks to access
-	num_of_chunks_to_access = 1;
-	if(n > num_bytes_till_end_of_chunk){
-		uint64_t n_temp = n - num_bytes_till_end_of_chunk;
-		num_of_chunks_to_access += (n_temp / superblock->disk_chunk_size);
-	}
-
-	//first chunk
-	if(n > num_bytes_till_end_of_chunk){
-		bytes_to_read_in_first_iteration = num_bytes_till_end_of_chunk;
-		n -= bytes_to_read_in_first_iteration;
-	}else{
-		bytes_to_read_in_first_iteration = n;
-	}
-	chunk = this->resolve_indirection(chunk_number);
-	std::memcpy(buf, (void*)chunk.get(), bytes_to_read_in_first_iteration);
-	buf += bytes_to_read_in_first_iteration;
-	chunk_number++;
-
-	//middle chunk
-	if(num_of_chunks_to_access > 2){
-		for(i = 1; i < (num_of_chunks_to_access - 1); i++){
-			chunk = resolve_indirection(chunk_number);
-			std::memcpy(buf, (void*)chunk.get(), chunk->size_bytes);
-			buf += chunk->size_bytes;
-			chunk_number++;
-			n -= chunk->size_bytes;
-		}
-	}
-
-	//last chunk
-	if(num_of_chunks_to_access != 1){
-		chunk = resolve_indirection(chunk_number);
-		std::memcpy((void*)chunk.get(), buf, n);
-	}
-	
-	return n_copy;
+    const uint64_t chunk_size = superblock->disk_chunk_size;
+
+    if (starting_offset >= data.file_size || n == 0) 
+        return 0;
+    if (starting_offset + n > data.file_size) 
+        n = data.file_size - starting_offset;
+
+    if (this->has_inline_data()) {
+        std::memcpy(buf, (const char *)data.addresses + starting_offset, n);
+        return n;
+    }
+
+    const uint64_t first_chunk = starting_offset / chunk_size;
+    const uint64_t last_chunk = (starting_offset + n - 1) / chunk_size;
+    std::vector<ChunkExtent> extents;
+    this->map_range(first_chunk, last_chunk - first_chunk + 1, extents);
+
+    for (const ChunkExtent &extent : extents) {
+        // with direct I/O the whole chunks of the extent are read in one go
+        uint64_t direct_begin = extent.count;
+        uint64_t direct_end = extent.count;
+        if (direct_io && extent.physical != 0 && !extent.unwritten) {
+            direct_begin = extent.logical * chunk_size >= starting_offset ? 0 : 1;
+            direct_end = (extent.logical + extent.count) * chunk_size <= starting_offset + n ? extent.count : extent.count - 1;
+            if (direct_begin < direct_end) {
+                const uint64_t chunk_start = (extent.logical + direct_begin) * chunk_size;
+                superblock->disk->read_chunks(extent.physical + direct_begin, direct_end - direct_begin, 
+                    (Byte *)buf + (chunk_start - starting_offset));
+            }
+        }
+
+        for (uint64_t i = 0; i < extent.count; ++i) {
+            if (i >= direct_begin && i < direct_end) 
+                continue;
+            const uint64_t chunk_number = extent.logical + i;
+            const uint64_t chunk_start = chunk_number * chunk_size;
+            const uint64_t from = std::max(starting_offset, chunk_start);
+            const uint64_t length = std::min(starting_offset + n, chunk_start + chunk_size) - from;
+            char *dst = buf + (from - starting_offset);
+
+            auto buffered = delalloc_chunks.find(chunk_number);
+            if (buffered != delalloc_chunks.end()) {
+                std::memcpy(dst, buffered->second.get() + (from - chunk_start), length);
+            } else if (extent.unwritten || extent.physical == 0) {
+                // holes and preallocated chunks read as zeros without touching the disk
+                std::memset(dst, 0, length);
+            } else {
+                std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(extent.physical + i);
+                std::memcpy(dst, chunk->data.get() + (from - chunk_start), length);
+            }
+        }
+    }
+
+    return n;
 }
+uint64_t INode::read_spans(uint64_t starting_offset, uint64_t n, std::vector<ReadSpan> &spans) {
+    static const Byte zeros[ZERO_SPAN_SIZE] = {0};
+    const uint64_t chunk_size = superblock->disk_chunk_size;
 
-std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number) {
+    if (starting_offset >= data.file_size || n == 0) 
+        return 0;
+    if (starting_offset + n > data.file_size) 
+        n = data.file_size - starting_offset;
+
+    // inline data starts at the beginning of the address area, so its offset
+    // there is the file offset
+    if (this->has_inline_data()) {
+        ReadSpan span;
+        span.data = (const Byte *)data.addresses + starting_offset;
+        span.offset = starting_offset;
+        span.length = n;
+        spans.push_back(span);
+        return n;
+    }
+
+    const uint64_t first_chunk = starting_offset / chunk_size;
+    const uint64_t last_chunk = (starting_offset + n - 1) / chunk_size;
+    auto buffered = delalloc_chunks.lower_bound(first_chunk);
+    if (buffered != delalloc_chunks.end() && buffered->first <= last_chunk) 
+        this->flush();
+
+    std::vector<ChunkExtent> extents;
+    this->map_range(first_chunk, last_chunk - first_chunk + 1, extents);
+    for (const ChunkExtent &extent : extents) {
+        const uint64_t extent_start = std::max(starting_offset, extent.logical * chunk_size);
+        const uint64_t extent_end = std::min(starting_offset + n, (extent.logical + extent.count) * chunk_size);
+
+        // zeros are handed out in as few spans as the shared buffer allows
+        if (extent.unwritten || extent.physical == 0) {
+            for (uint64_t from = extent_start; from < extent_end; from += ZERO_SPAN_SIZE) {
+                ReadSpan span;
+                span.data = zeros;
+                span.length = std::min(ZERO_SPAN_SIZE, extent_end - from);
+                spans.push_back(span);
+            }
+            continue;
+        }
+
+        for (uint64_t from = extent_start; from < extent_end;) {
+            const uint64_t chunk_number = from / chunk_size;
+            ReadSpan span;
+            span.chunk = superblock->disk->get_chunk(extent.physical + (chunk_number - extent.logical));
+            span.offset = from % chunk_size;
+            span.length = std::min(extent_end - from, chunk_size - span.offset);
+            span.data = span.chunk->data.get() + span.offset;
+            spans.push_back(std::move(span));
+            from += spans.back().length;
+        }
+    }
+
+    return n;
+}
+
+uint64_t INode::buffered_write(uint64_t starting_offset, const char *buf, uint64_t n) {
+    const uint64_t chunk_size = superblock->disk_chunk_size;
+    if (this->write_inline(starting_offset, buf, n)) 
+        return n;
+
+    uint64_t done = 0;
+    while (done < n) {
+        const uint64_t chunk_number = (starting_offset + done) / chunk_size;
+        const uint64_t byte_offset = (starting_offset + done) % chunk_size;
+        const uint64_t length = std::min(chunk_size - byte_offset, n - done);
+
+        auto buffered = delalloc_chunks.find(chunk_number);
+        if (buffered != delalloc_chunks.end()) {
+            std::memcpy(buffered->second.get() + byte_offset, buf + done, length);
+            done += length;
+            continue;
+        }
+
+        // chunks that already exist are written in place
+        const uint64_t address = this->lookup_address(chunk_number);
+        if (address != 0) {
+            std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(address_chunk(address));
+            if (address & UNWRITTEN_FLAG) {
+                std::memset(chunk->data.get(), 0, chunk->size_bytes);
+                this->set_addresses(chunk_number, address_chunk(address), 1);
+            }
+            std::memcpy(chunk->data.get() + byte_offset, buf + done, length);
+            done += length;
+            continue;
+        }
+
+        // otherwise only space is reserved, the chunk is picked when flushing. 
+        // the first buffered chunk of a leaf reserves the indirect chunks as well
+        uint64_t reserve = 1;
+        if (this->extent_mapped()) {
+            const uint64_t extent_count = extent_map.size() + delalloc_chunks.size();
+            reserve += this->extent_tree_chunks_for(extent_count + 1) - this->extent_tree_chunks_for(extent_count);
+        } else {
+            const uint64_t leaf_first = this->leaf_first_chunk(chunk_number);
+            auto sibling = delalloc_chunks.lower_bound(leaf_first);
+            if (sibling == delalloc_chunks.end() || this->leaf_first_chunk(sibling->first) != leaf_first) 
+                reserve += this->indirect_chunks_for(chunk_number);
+        }
+        superblock->reserve_chunks(reserve);
+        delalloc_reserved += reserve;
+        std::unique_ptr<Byte[]> buffer(new Byte[chunk_size]);
+        std::memset(buffer.get(), 0, chunk_size);
+        std::memcpy(buffer.get() + byte_offset, buf + done, length);
+        delalloc_chunks[chunk_number] = std::move(buffer);
+        done += length;
+    }
+
+    if (starting_offset + n > data.file_size) 
+        data.file_size = starting_offset + n;
+    data.last_modified = time(nullptr);
+    dirty = true;
+    return n;
+}
+
+void INode::flush() {
+    // everything mapping the buffered chunks allocates, the data itself, indirect
+    // chunks and extent tree chunks, comes out of this inode's reservation
+    flushing = true;
+    try {
+        this->flush_buffered();
+        this->store_extents();
+    } catch (...) {
+        flushing = false;
+        throw;
+    }
+    flushing = false;
+    this->trim_delalloc_reservation();
+}
+
+void INode::flush_buffered() {
+    while (!delalloc_chunks.empty()) {
+        // try to place the whole dirty range right after the chunk preceding it
+        auto it = delalloc_chunks.begin();
+        uint64_t goal = 0;
+        if (it->first > 0 && this->lookup_address(it->first - 1) != 0) 
+            goal = address_chunk(this->lookup_address(it->first - 1)) + 1;
+
+        DiskBitMap::BitRange range = superblock->allocate_extent(1, delalloc_chunks.size(), goal, &delalloc_reserved);
+        uint64_t mapped = 0;
+        try {
+            for (; mapped < range.bit_count; ++mapped) {
+                it = delalloc_chunks.begin();
+                std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(range.start_idx + mapped);
+                std::memcpy(chunk->data.get(), it->second.get(), chunk->size_bytes);
+
+                this->set_addresses(it->first, range.start_idx + mapped, 1);
+                delalloc_chunks.erase(it);
+            }
+        } catch (...) {
+            // the chunks that were not mapped stay buffered and reserved
+            superblock->free_extent(range.start_idx + mapped, range.bit_count - mapped);
+            this->trim_delalloc_reservation();
+            throw;
+        }
+
+        // whatever did not fit in this extent stays reserved for the next one
+        this->trim_delalloc_reservation();
+    }
+}
+
+uint64_t INode::leaf_first_chunk(uint64_t chunk_number) const {
+    if (chunk_number < DIRECT_ADDRESS_COUNT) 
+        return chunk_number;
+    const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    return chunk_number - (chunk_number - DIRECT_ADDRESS_COUNT) % num_chunk_address_per_chunk;
+}
+
+uint64_t INode::indirect_chunks_for(uint64_t chunk_number) const {
+    if (chunk_number < DIRECT_ADDRESS_COUNT || this->extent_mapped()) 
+        return 0;
+
+    // a leaf, and one more chunk for every level above it
     const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
-    uint64_t indirect_address_count = 1;
+    uint64_t remaining = chunk_number - DIRECT_ADDRESS_COUNT;
+    uint64_t level_chunks = num_chunk_address_per_chunk;
+    uint64_t levels = 1;
+    while (remaining >= level_chunks) {
+        remaining -= level_chunks;
+        level_chunks *= num_chunk_address_per_chunk;
+        levels++;
+    }
+    return levels;
+}
+
+uint64_t INode::delalloc_reservation() const {
+    if (this->extent_mapped()) {
+        const uint64_t tree_chunks = this->extent_tree_chunks_for(extent_map.size() + delalloc_chunks.size());
+        if (tree_chunks <= extent_tree_chunks.size()) 
+            return delalloc_chunks.size();
+        return delalloc_chunks.size() + tree_chunks - extent_tree_chunks.size();
+    }
+
+    uint64_t needed = 0;
+    uint64_t last_leaf = ~0ull;
+    for (auto &buffered : delalloc_chunks) {
+        const uint64_t leaf_first = this->leaf_first_chunk(buffered.first);
+        needed++;
+        if (leaf_first != last_leaf) 
+            needed += this->indirect_chunks_for(buffered.first);
+        last_leaf = leaf_first;
+    }
+    return needed;
+}
+
+void INode::trim_delalloc_reservation() {
+    const uint64_t needed = this->delalloc_reservation();
+    if (delalloc_reserved > needed) {
+        superblock->release_chunks(delalloc_reserved - needed);
+        delalloc_reserved = needed;
+    }
+}
+
+uint64_t *INode::address_slot(uint64_t chunk_number, bool create, std::shared_ptr<Chunk> &holder) {
+    const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    uint64_t indirect_address_count = 1; // chunks addressed by one slot at the current level
+
+    // every level is a whole number of leaves, so leaves are numbered across them
+    const uint64_t leaf_number = (chunk_number - DIRECT_ADDRESS_COUNT) / num_chunk_address_per_chunk;
+    if (chunk_number >= DIRECT_ADDRESS_COUNT) {
+        auto cached = mapping_cache.find(leaf_number);
+        if (cached != mapping_cache.end()) {
+            cached->second.last_used = ++mapping_cache_clock;
+            holder = cached->second.leaf;
+            return (uint64_t *)holder->data.get() + (chunk_number - DIRECT_ADDRESS_COUNT) % num_chunk_address_per_chunk;
+        }
+    }
 
     uint64_t *indirect_table = data.addresses;
     for(uint64_t indirection = 0; indirection < sizeof(INDIRECT_TABLE_SIZES) / sizeof(uint64_t); indirection++){
         if(chunk_number < (indirect_address_count * INDIRECT_TABLE_SIZES[indirection])){
-            uint64_t next_chunk_loc = indirect_table[chunk_number / indirect_address_count];
-            if(next_chunk_loc == 0){
-                std::shared_ptr<Chunk> chunk = this->superblock->allocate_chunk();
-                std::memset((void *)chunk->data.get(), 0, chunk->size_bytes);
-                indirect_table[chunk_number / indirect_address_count] = chunk->chunk_idx;
-            }
-            auto chunk = superblock->disk->get_chunk(next_chunk_loc);
+            uint64_t *slot = &indirect_table[chunk_number / indirect_address_count];
+            chunk_number %= indirect_address_count;
+
+            // walk down through the indirect chunks
             while(indirection != 0){
-                uint64_t *lookup_table = (uint64_t *)chunk->data.get();
-                next_chunk_loc = lookup_table[chunk_number / indirect_address_count];
-                if(next_chunk_loc == 0) {
-                    std::shared_ptr<Chunk> chunk = this->superblock->allocate_chunk();
+                if(*slot == 0){
+                    if(!create) 
+                        return nullptr;
+                    std::shared_ptr<Chunk> chunk = this->superblock->allocate_chunk(this->allocation_goal(), 
+                        flushing ? &delalloc_reserved : nullptr);
                     std::memset((void *)chunk->data.get(), 0, chunk->size_bytes);
-                    lookup_table[chunk_number / indirect_address_count] = chunk->chunk_idx;
+                    *slot = chunk->chunk_idx;
+                    holder = std::move(chunk);
                 } else {
-                    chunk = superblock->disk->get_chunk(next_chunk_loc);
+                    holder = superblock->disk->get_chunk(*slot);
                 }
                 indirect_address_count /= num_chunk_address_per_chunk;
+                slot = (uint64_t *)holder->data.get() + chunk_number / indirect_address_count;
+                chunk_number %= indirect_address_count;
                 indirection--;
+
+                if (indirection == 0) 
+                    this->cache_leaf(leaf_number, holder);
             }
-            return chunk;
+            return slot;
         }
         chunk_number -= (indirect_address_count * INDIRECT_TABLE_SIZES[indirection]);
         indirect_table += INDIRECT_TABLE_SIZES[indirection];
         indirect_address_count *= num_chunk_address_per_chunk;
     }
-    return nullptr;
+    throw FileSystemException("Chunk number is beyond the largest file size supported");
+}
+
+void INode::map_range(uint64_t first_chunk, uint64_t count, std::vector<ChunkExtent> &extents) {
+    this->migrate_inline_data();
+    const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    const uint64_t end_chunk = first_chunk + count;
+    extents.clear();
+
+    auto append = [&](uint64_t logical, uint64_t address, uint64_t length) {
+        const uint64_t physical = address_chunk(address);
+        const bool unwritten = (address & UNWRITTEN_FLAG) != 0;
+        if (!extents.empty()) {
+            ChunkExtent &last = extents.back();
+            const bool follows = physical == 0 ? last.physical == 0 : 
+                (last.physical != 0 && physical == last.physical + last.count);
+            if (follows && last.unwritten == unwritten) {
+                last.count += length;
+                return ;
+            }
+        }
+        ChunkExtent extent;
+        extent.logical = logical;
+        extent.physical = physical;
+        extent.count = length;
+        extent.unwritten = unwritten;
+        extents.push_back(extent);
+    };
+
+    if (this->extent_mapped()) {
+        this->load_extents();
+        uint64_t chunk_number = first_chunk;
+        auto it = extent_map.upper_bound(first_chunk);
+        if (it != extent_map.begin()) 
+            --it;
+        for (; chunk_number < end_chunk && it != extent_map.end(); ++it) {
+            const ChunkExtent &extent = it->second;
+            if (extent.logical + extent.count <= chunk_number) 
+                continue;
+            if (extent.logical >= end_chunk) 
+                break;
+            if (extent.logical > chunk_number) {
+                append(chunk_number, 0, extent.logical - chunk_number);
+                chunk_number = extent.logical;
+            }
+            const uint64_t skip = chunk_number - extent.logical;
+            const uint64_t length = std::min(end_chunk, extent.logical + extent.count) - chunk_number;
+            append(chunk_number, (extent.physical + skip) | (extent.unwritten ? UNWRITTEN_FLAG : 0), length);
+            chunk_number += length;
+        }
+        if (chunk_number < end_chunk) 
+            append(chunk_number, 0, end_chunk - chunk_number);
+        return ;
+    }
+
+    // one walk per leaf, the slots inside a leaf are consecutive
+    uint64_t chunk_number = first_chunk;
+    while (chunk_number < end_chunk) {
+        std::shared_ptr<Chunk> holder;
+        uint64_t *slots = nullptr;
+        uint64_t span = 0;
+        if (chunk_number < DIRECT_ADDRESS_COUNT) {
+            slots = &data.addresses[chunk_number];
+            span = std::min(end_chunk, DIRECT_ADDRESS_COUNT) - chunk_number;
+        } else {
+            const uint64_t into_leaf = (chunk_number - DIRECT_ADDRESS_COUNT) % num_chunk_address_per_chunk;
+            span = std::min(end_chunk - chunk_number, num_chunk_address_per_chunk - into_leaf);
+            slots = this->address_slot(chunk_number, false, holder);
+            if (slots == nullptr) {
+                append(chunk_number, 0, span);
+                chunk_number += span;
+                continue;
+            }
+        }
+
+        for (uint64_t i = 0; i < span; ++i) 
+            append(chunk_number + i, slots[i], 1);
+        chunk_number += span;
+    }
+}
+
+uint64_t INode::lookup_address(uint64_t chunk_number) {
+    this->migrate_inline_data();
+    if (this->extent_mapped()) {
+        this->load_extents();
+        auto it = extent_map.upper_bound(chunk_number);
+        if (it == extent_map.begin()) 
+            return 0;
+        const ChunkExtent &extent = (--it)->second;
+        if (chunk_number >= extent.logical + extent.count) 
+            return 0;
+        return (extent.physical + chunk_number - extent.logical) | (extent.unwritten ? UNWRITTEN_FLAG : 0);
+    }
+
+    std::shared_ptr<Chunk> holder;
+    uint64_t *slot = this->address_slot(chunk_number, false, holder);
+    return slot == nullptr ? 0 : *slot;
+}
+
+void INode::set_addresses(uint64_t chunk_number, uint64_t address, uint64_t count) {
+    this->migrate_inline_data();
+    dirty = true;
+    if (!this->extent_mapped()) {
+        for (uint64_t i = 0; i < count; ++i) {
+            std::shared_ptr<Chunk> holder;
+            *this->address_slot(chunk_number + i, true, holder) = address + i;
+        }
+        return ;
+    }
+
+    this->load_extents();
+    extents_dirty = true;
+    const uint64_t end_chunk = chunk_number + count;
+
+    // cut whatever overlaps the new run out of the extents around it
+    auto it = extent_map.upper_bound(chunk_number);
+    if (it != extent_map.begin()) 
+        --it;
+    while (it != extent_map.end() && it->second.logical < end_chunk) {
+        ChunkExtent extent = it->second;
+        if (extent.logical + extent.count <= chunk_number) {
+            ++it;
+            continue;
+        }
+        it = extent_map.erase(it);
+        if (extent.logical < chunk_number) {
+            ChunkExtent head = extent;
+            head.count = chunk_number - extent.logical;
+            extent_map[head.logical] = head;
+        }
+        if (extent.logical + extent.count > end_chunk) {
+            ChunkExtent tail = extent;
+            tail.logical = end_chunk;
+            tail.physical = extent.physical + (end_chunk - extent.logical);
+            tail.count = extent.logical + extent.count - end_chunk;
+            it = extent_map.insert(std::make_pair(tail.logical, tail)).first;
+        }
+    }
+
+    ChunkExtent extent;
+    extent.logical = chunk_number;
+    extent.physical = address_chunk(address);
+    extent.count = count;
+    extent.unwritten = (address & UNWRITTEN_FLAG) != 0;
+
+    // and merge it with its neighbours when they continue on disk
+    auto next = extent_map.lower_bound(end_chunk);
+    if (next != extent_map.end() && next->second.logical == end_chunk && 
+            next->second.physical == extent.physical + count && next->second.unwritten == extent.unwritten) {
+        extent.count += next->second.count;
+        extent_map.erase(next);
+    }
+    auto prev = extent_map.lower_bound(chunk_number);
+    if (prev != extent_map.begin()) {
+        --prev;
+        ChunkExtent &before = prev->second;
+        if (before.logical + before.count == chunk_number && 
+                before.physical + before.count == extent.physical && before.unwritten == extent.unwritten) {
+            before.count += extent.count;
+            return ;
+        }
+    }
+    extent_map[extent.logical] = extent;
+}
+
+uint64_t INode::allocation_goal() {
+    if (this->extent_mapped()) {
+        this->load_extents();
+        return extent_map.empty() ? 0 : extent_map.begin()->second.physical;
+    }
+    return address_chunk(data.addresses[0]);
+}
+
+void INode::use_extent_mapping() {
+    if (this->extent_mapped()) 
+        return ;
+    this->migrate_inline_data();
+    for (uint64_t address : data.addresses) {
+        if (address != 0) 
+            throw FileSystemException("INode already has chunks, it can not switch to extent mapping");
+    }
+    if (!delalloc_chunks.empty()) 
+        throw FileSystemException("INode already has chunks, it can not switch to extent mapping");
+
+    data.inode_bits.set(EXTENT_MAPPED_BIT);
+    dirty = true;
+    extent_map.clear();
+    extent_tree_chunks.clear();
+    extents_loaded = true;
+    extents_dirty = true;
+}
+
+bool INode::write_inline(uint64_t starting_offset, const char *buf, uint64_t n) {
+    if (starting_offset + n > INLINE_DATA_SIZE || this->extent_mapped()) {
+        this->migrate_inline_data();
+        return false;
+    }
+
+    // only a file without any chunks can start keeping its data inline
+    if (!this->has_inline_data()) {
+        if (data.file_size != 0 || !delalloc_chunks.empty()) 
+            return false;
+        for (uint64_t address : data.addresses) {
+            if (address != 0) 
+                return false;
+        }
+        data.inode_bits.set(INLINE_DATA_BIT);
+    }
+
+    std::memcpy((char *)data.addresses + starting_offset, buf, n);
+    if (starting_offset + n > data.file_size) 
+        data.file_size = starting_offset + n;
+    data.last_modified = time(nullptr);
+    dirty = true;
+    return true;
+}
+
+void INode::migrate_inline_data() {
+    if (!this->has_inline_data()) 
+        return ;
+
+    char contents[INLINE_DATA_SIZE];
+    const uint64_t size = data.file_size;
+    std::memcpy(contents, data.addresses, sizeof(contents));
+    std::memset(data.addresses, 0, sizeof(data.addresses));
+    data.inode_bits.reset(INLINE_DATA_BIT);
+
+    // the size is left as it is, so the write can not go back inline
+    const uint64_t last_modified = data.last_modified;
+    this->write(0, contents, size);
+    data.last_modified = last_modified;
+}
+
+void INode::load_extents() {
+    if (extents_loaded) 
+        return ;
+    extents_loaded = true;
+    extent_map.clear();
+    extent_tree_chunks.clear();
+
+    auto add = [&](const uint64_t *words) {
+        ChunkExtent extent;
+        extent.logical = words[0];
+        extent.physical = address_chunk(words[1]);
+        extent.unwritten = (words[1] & UNWRITTEN_FLAG) != 0;
+        extent.count = words[2];
+        extent_map[extent.logical] = extent;
+    };
+
+    if (data.addresses[EXTENT_TREE_ROOT] == 0) {
+        for (uint64_t i = 0; i < data.addresses[EXTENT_COUNT]; ++i) 
+            add(&data.addresses[i * 3]);
+        return ;
+    }
+
+    // every tree node starts with its entry count and level, leaves (level 0) 
+    // hold extent triples, the levels above (first logical chunk, child) pairs
+    std::vector<uint64_t> pending(1, data.addresses[EXTENT_TREE_ROOT]);
+    while (!pending.empty()) {
+        const uint64_t node_chunk = pending.back();
+        pending.pop_back();
+        extent_tree_chunks.push_back(node_chunk);
+
+        std::shared_ptr<Chunk> node = superblock->disk->get_chunk(node_chunk);
+        const uint64_t *words = (const uint64_t *)node->data.get();
+        for (uint64_t i = 0; i < words[0]; ++i) {
+            if (words[1] == 0) 
+                add(&words[2 + i * 3]);
+            else 
+                pending.push_back(words[2 + i * 2 + 1]);
+        }
+    }
+}
+uint64_t INode::extent_tree_chunks_for(uint64_t extent_count) const {
+    if (extent_count <= INLINE_EXTENT_COUNT) 
+        return 0;
+
+    const uint64_t words_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    const uint64_t extents_per_leaf = (words_per_chunk - 2) / 3;
+    const uint64_t children_per_node = (words_per_chunk - 2) / 2;
+    uint64_t level_size = (extent_count + extents_per_leaf - 1) / extents_per_leaf;
+    uint64_t chunks = level_size;
+    while (level_size > 1) {
+        level_size = (level_size + children_per_node - 1) / children_per_node;
+        chunks += level_size;
+    }
+    return chunks;
+}
+
+void INode::store_extents() {
+    if (!this->extent_mapped() || !extents_dirty) 
+        return ;
+
+    const uint64_t words_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    const uint64_t extents_per_leaf = (words_per_chunk - 2) / 3;
+    const uint64_t children_per_node = (words_per_chunk - 2) / 2;
+
+    // small maps live inline in the address area, the tree is only used beyond 
+    // it. it is rebuilt bottom up, reusing the chunks it had before
+    std::vector<uint64_t> level_sizes;
+    uint64_t chunks_needed = 0;
+    if (extent_map.size() > INLINE_EXTENT_COUNT) {
+        level_sizes.push_back((extent_map.size() + extents_per_leaf - 1) / extents_per_leaf);
+        while (level_sizes.back() > 1) 
+            level_sizes.push_back((level_sizes.back() + children_per_node - 1) / children_per_node);
+        for (uint64_t size : level_sizes) 
+            chunks_needed += size;
+    }
+    while (extent_tree_chunks.size() > chunks_needed) {
+        superblock->free_chunk(extent_tree_chunks.back());
+        extent_tree_chunks.pop_back();
+    }
+    while (extent_tree_chunks.size() < chunks_needed) {
+        const uint64_t goal = extent_tree_chunks.empty() ? this->allocation_goal() : extent_tree_chunks.back() + 1;
+        extent_tree_chunks.push_back(superblock->allocate_chunk(goal, flushing ? &delalloc_reserved : nullptr)->chunk_idx);
+    }
+    // only clean once nothing can fail, a failed store is retried in full
+    extents_dirty = false;
+
+    std::memset(data.addresses, 0, sizeof(data.addresses));
+    data.addresses[EXTENT_COUNT] = extent_map.size();
+    auto store = [](uint64_t *words, const ChunkExtent &extent) {
+        words[0] = extent.logical;
+        words[1] = extent.physical | (extent.unwritten ? UNWRITTEN_FLAG : 0);
+        words[2] = extent.count;
+    };
+
+    if (chunks_needed == 0) {
+        uint64_t i = 0;
+        for (auto &entry : extent_map) 
+            store(&data.addresses[3 * i++], entry.second);
+        return ;
+    }
+
+    // (first logical chunk, node chunk) of every node on the level just written
+    std::vector<std::pair<uint64_t, uint64_t>> written;
+    std::vector<std::pair<uint64_t, uint64_t>> above;
+    uint64_t next_chunk = 0;
+    auto it = extent_map.begin();
+    for (uint64_t level = 0; level < level_sizes.size(); ++level) {
+        size_t child = 0;
+        above.clear();
+        for (uint64_t node_idx = 0; node_idx < level_sizes[level]; ++node_idx) {
+            std::shared_ptr<Chunk> node = superblock->disk->get_chunk(extent_tree_chunks[next_chunk++]);
+            uint64_t *words = (uint64_t *)node->data.get();
+            std::memset(words, 0, superblock->disk_chunk_size);
+            words[1] = level;
+            if (level == 0) {
+                above.push_back(std::make_pair(it->second.logical, node->chunk_idx));
+                for (; it != extent_map.end() && words[0] < extents_per_leaf; ++it) 
+                    store(&words[2 + 3 * words[0]++], it->second);
+            } else {
+                above.push_back(std::make_pair(written[child].first, node->chunk_idx));
+                for (; child < written.size() && words[0] < children_per_node; ++child) {
+                    words[2 + 2 * words[0]] = written[child].first;
+                    words[2 + 2 * words[0]++ + 1] = written[child].second;
+                }
+            }
+        }
+        written.swap(above);
+    }
+    data.addresses[EXTENT_TREE_ROOT] = written[0].second;
+}
+void INode::cache_leaf(uint64_t leaf_number, const std::shared_ptr<Chunk> &leaf) {
+    // evict the least recently used leaf, the cache is small enough to scan
+    if (mapping_cache.size() >= MAPPING_CACHE_LEAVES) {
+        auto oldest = mapping_cache.begin();
+        for (auto it = mapping_cache.begin(); it != mapping_cache.end(); ++it) {
+            if (it->second.last_used < oldest->second.last_used) 
+                oldest = it;
+        }
+        mapping_cache.erase(oldest);
+    }
+
+    MappingCacheEntry &entry = mapping_cache[leaf_number];
+    entry.leaf = leaf;
+    entry.last_used = ++mapping_cache_clock;
+}
+
+std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number) {
+    const uint64_t address = this->lookup_address(chunk_number);
+    if(address == 0){
+        std::shared_ptr<Chunk> chunk = this->superblock->allocate_chunk(this->allocation_goal());
+        std::memset((void *)chunk->data.get(), 0, chunk->size_bytes);
+        this->set_addresses(chunk_number, chunk->chunk_idx, 1);
+        return chunk;
+    }
+
+    // the chunk is about to be used, so a preallocated chunk gets its zeros now
+    std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(address_chunk(address));
+    if(address & UNWRITTEN_FLAG){
+        std::memset((void *)chunk->data.get(), 0, chunk->size_bytes);
+        this->set_addresses(chunk_number, address_chunk(address), 1);
+    }
+    return chunk;
+}
+void INode::truncate(uint64_t new_size) {
+    const uint64_t chunk_size = superblock->disk_chunk_size;
+    if (this->has_inline_data()) {
+        if (new_size <= INLINE_DATA_SIZE) {
+            if (new_size < data.file_size) 
+                std::memset((char *)data.addresses + new_size, 0, data.file_size - new_size);
+            data.file_size = new_size;
+            data.last_modified = time(nullptr);
+            dirty = true;
+            return ;
+        }
+        this->migrate_inline_data();
+    }
+
+    // the rest of the new last chunk must read as zeros if the file grows again
+    const uint64_t keep_chunks = (new_size + chunk_size - 1) / chunk_size;
+    if (new_size < data.file_size && new_size % chunk_size != 0) {
+        const uint64_t tail = new_size % chunk_size;
+        auto buffered = delalloc_chunks.find(new_size / chunk_size);
+        const uint64_t address = this->lookup_address(new_size / chunk_size);
+        if (buffered != delalloc_chunks.end()) {
+            std::memset(buffered->second.get() + tail, 0, chunk_size - tail);
+        } else if (address != 0 && !(address & UNWRITTEN_FLAG)) {
+            std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(address);
+            std::memset(chunk->data.get() + tail, 0, chunk_size - tail);
+        }
+    }
+
+    for (auto it = delalloc_chunks.lower_bound(keep_chunks); it != delalloc_chunks.end(); ) 
+        it = delalloc_chunks.erase(it);
+    this->trim_delalloc_reservation();
+
+    std::vector<uint64_t> freed;
+    if (this->extent_mapped()) {
+        this->load_extents();
+        auto it = extent_map.upper_bound(keep_chunks);
+        if (it != extent_map.begin()) 
+            --it;
+        while (it != extent_map.end()) {
+            ChunkExtent &extent = it->second;
+            if (extent.logical + extent.count <= keep_chunks) {
+                ++it;
+                continue;
+            }
+            const uint64_t kept = extent.logical < keep_chunks ? keep_chunks - extent.logical : 0;
+            for (uint64_t i = kept; i < extent.count; ++i) 
+                freed.push_back(extent.physical + i);
+            extents_dirty = true;
+            if (kept == 0) {
+                it = extent_map.erase(it);
+            } else {
+                extent.count = kept;
+                ++it;
+            }
+        }
+    } else {
+        const uint64_t num_chunk_address_per_chunk = chunk_size / sizeof(uint64_t);
+        uint64_t first_logical = 0;
+        uint64_t covered = 1; // chunks mapped by one slot at the current depth
+        uint64_t slot = 0;
+        for (uint64_t depth = 0; depth < sizeof(INDIRECT_TABLE_SIZES) / sizeof(uint64_t); ++depth) {
+            for (uint64_t i = 0; i < INDIRECT_TABLE_SIZES[depth]; ++i, ++slot) {
+                this->truncate_slot(data.addresses[slot], depth, first_logical, keep_chunks, freed);
+                first_logical += covered;
+            }
+            covered *= num_chunk_address_per_chunk;
+        }
+        this->drop_mapping_cache();
+    }
+
+    // hand the chunks back as sorted runs
+    std::sort(freed.begin(), freed.end());
+    for (size_t start = 0; start < freed.size();) {
+        size_t end = start + 1;
+        while (end < freed.size() && freed[end] == freed[end - 1] + 1) 
+            ++end;
+        superblock->free_extent(freed[start], end - start);
+        start = end;
+    }
+
+    data.file_size = new_size;
+    data.last_modified = time(nullptr);
+    dirty = true;
+}
+
+void INode::truncate_slot(uint64_t &slot, uint64_t depth, uint64_t first_logical, uint64_t keep_chunks, std::vector<uint64_t> &freed) {
+    if (slot == 0) 
+        return ;
+    if (depth == 0) {
+        if (first_logical >= keep_chunks) {
+            freed.push_back(address_chunk(slot));
+            slot = 0;
+        }
+        return ;
+    }
+
+    const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    uint64_t child_covers = 1;
+    for (uint64_t level = 1; level < depth; ++level) 
+        child_covers *= num_chunk_address_per_chunk;
+    if (first_logical + child_covers * num_chunk_address_per_chunk <= keep_chunks) 
+        return ;
+
+    // children that end before keep_chunks are left alone
+    std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(slot);
+    uint64_t *children = (uint64_t *)chunk->data.get();
+    const uint64_t first_child = first_logical >= keep_chunks ? 0 : (keep_chunks - first_logical) / child_covers;
+    for (uint64_t i = first_child; i < num_chunk_address_per_chunk; ++i) 
+        this->truncate_slot(children[i], depth - 1, first_logical + i * child_covers, keep_chunks, freed);
+
+    if (first_logical >= keep_chunks) {
+        freed.push_back(slot);
+        slot = 0;
+    }
+}
+
+void INode::preallocate(uint64_t starting_offset, uint64_t n, bool keep_size) {
+    if (n == 0) 
+        return ;
+    this->migrate_inline_data();
+
+    const uint64_t chunk_size = superblock->disk_chunk_size;
+    this->allocate_holes(starting_offset / chunk_size, (starting_offset + n - 1) / chunk_size);
+
+    if (!keep_size && starting_offset + n > data.file_size) 
+        data.file_size = starting_offset + n;
+    data.last_modified = time(nullptr);
+    dirty = true;
 }
 
-INodeTable::INodeTable(SuperBlock *superblock, uint64_t offset, uint64_t size) : superblock(superblock) {
+void INode::allocate_holes(uint64_t first_chunk, uint64_t last_chunk) {
+    // find the holes first so that they can be allocated in one request
+    std::vector<ChunkExtent> extents;
+    this->map_range(first_chunk, last_chunk - first_chunk + 1, extents);
+    std::vector<uint64_t> holes;
+    for (const ChunkExtent &extent : extents) {
+        if (extent.physical != 0) 
+            continue;
+        for (uint64_t i = 0; i < extent.count; ++i) {
+            if (delalloc_chunks.count(extent.logical + i) == 0) 
+                holes.push_back(extent.logical + i);
+        }
+    }
+
+    uint64_t goal = 0;
+    for (size_t hole = 0; hole < holes.size();) {
+        if (goal == 0 && holes[hole] > 0 && this->lookup_address(holes[hole] - 1) != 0) 
+            goal = address_chunk(this->lookup_address(holes[hole] - 1)) + 1;
+
+        // the extent is mapped in runs of logically consecutive holes
+        DiskBitMap::BitRange range = superblock->allocate_extent(1, holes.size() - hole, goal);
+        for (uint64_t i = 0; i < range.bit_count;) {
+            uint64_t run = 1;
+            while (i + run < range.bit_count && holes[hole + run] == holes[hole] + run) 
+                ++run;
+            this->set_addresses(holes[hole], (range.start_idx + i) | UNWRITTEN_FLAG, run);
+            i += run;
+            hole += run;
+        }
+        goal = range.start_idx + range.bit_count;
+    }
+}
+uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t n) {
+    if (n == 0) 
+        return 0;
+    if (this->write_inline(starting_offset, buf, n)) 
+        return n;
+
+    const uint64_t chunk_size = superblock->disk_chunk_size;
+    const uint64_t first_chunk = starting_offset / chunk_size;
+    const uint64_t last_chunk = (starting_offset + n - 1) / chunk_size;
+    this->allocate_holes(first_chunk, last_chunk);
+
+    // the partial chunks at the edges are the only ones that are read first
+    auto write_partial = [&](uint64_t chunk_number) {
+        const uint64_t chunk_start = chunk_number * chunk_size;
+        const uint64_t from = std::max(starting_offset, chunk_start);
+        const uint64_t to = std::min(starting_offset + n, chunk_start + chunk_size);
+        auto buffered = delalloc_chunks.find(chunk_number);
+        if (buffered != delalloc_chunks.end()) {
+            std::memcpy(buffered->second.get() + (from - chunk_start), buf + (from - starting_offset), to - from);
+        } else {
+            std::shared_ptr<Chunk> chunk = this->resolve_indirection(chunk_number);
+            std::memcpy(chunk->data.get() + (from - chunk_start), buf + (from - starting_offset), to - from);
+        }
+    };
+
+    uint64_t full_begin = first_chunk;
+    uint64_t full_end = last_chunk + 1;
+    if (starting_offset % chunk_size != 0) {
+        write_partial(first_chunk);
+        full_begin = first_chunk + 1;
+    }
+    if ((starting_offset + n) % chunk_size != 0 && last_chunk >= full_begin) {
+        write_partial(last_chunk);
+        full_end = last_chunk;
+    }
+
+    // whole chunks go out one physical extent at a time, what is left unmapped
+    // after allocate_holes are chunks still buffered for delayed allocation
+    std::vector<ChunkExtent> extents;
+    if (full_end > full_begin) 
+        this->map_range(full_begin, full_end - full_begin, extents);
+    for (const ChunkExtent &extent : extents) {
+        const char *src = buf + (extent.logical * chunk_size - starting_offset);
+        if (extent.physical == 0) {
+            for (uint64_t i = 0; i < extent.count; ++i) 
+                std::memcpy(delalloc_chunks[extent.logical + i].get(), src + i * chunk_size, chunk_size);
+            continue;
+        }
+
+        if (extent.unwritten) 
+            this->set_addresses(extent.logical, extent.physical, extent.count);
+        superblock->disk->write_chunks(extent.physical, extent.count, (const Byte *)src);
+    }
+
+    if (starting_offset + n > data.file_size) 
+        data.file_size = starting_offset + n;
+    data.last_modified = time(nullptr);
+    dirty = true;
+    return n;
+}
+
+INodeTable::INodeTable(SuperBlock *superblock, uint64_t offset, uint64_t size) 
+    : superblock(superblock), initialized_groups(0), extension_count(0), inode_alloc_hint(0) {
     inode_table_size_chunks = size;
     inode_table_offset = offset;
-    inodes_per_chunk = superblock->disk_chunk_size / sizeof(INode::INodeData);
+    inodes_per_chunk = superblock->disk_chunk_size / INode::INodeData::RECORD_SIZE;
+
+    // the used_inodes bitmap comes out of the same chunks as the ilist, size it 
+    // for the worst case and then give whatever is left over to the ilist. the 
+    // last chunk is kept for the inode table map
+    uint64_t bitmap_size_chunks = DiskBitMap::size_chunks_for(superblock->disk_chunk_size, 0);
+    while (true) {
+        if (bitmap_size_chunks + 1 >= size) 
+            throw FileSystemException("INode table is too small to hold any inodes");
+        inode_count = inodes_per_chunk * (size - bitmap_size_chunks - 1);
+        uint64_t needed = DiskBitMap::size_chunks_for(superblock->disk_chunk_size, inode_count);
+        if (needed <= bitmap_size_chunks) 
+            break;
+        bitmap_size_chunks = needed;
+    }
 
     used_inodes = std::unique_ptr<DiskBitMap>(
         new DiskBitMap(superblock->disk, inode_table_offset, inode_count)
     );
 
-    inode_count = inodes_per_chunk * inode_table_size_chunks - used_inodes->size_chunks();
+    inode_ilist_offset = inode_table_offset + used_inodes->size_chunks();
+    inodes_per_group = superblock->disk_chunk_size * 8;
+    group_count = (inode_count + inodes_per_group - 1) / inodes_per_group;
+
+    inode_map_offset = inode_ilist_offset + (inode_count + inodes_per_chunk - 1) / inodes_per_chunk;
+    inodes_per_extension = inodes_per_chunk * (EXTENSION_CHUNKS - 1);
+    max_extensions = superblock->disk_chunk_size / sizeof(uint64_t) - 1;
+    extension_offsets.reserve(max_extensions);
+    extension_inodes.reserve(max_extensions);
 }
 
 void INodeTable::format_inode_table() {
     // no inodes are used initially
-    used_inodes->clear_all();
+    used_inodes->set_count = 0;
+    initialized_groups = 0;
+    inode_alloc_hint = 0;
+
+    std::shared_ptr<Chunk> map_chunk = superblock->disk->get_chunk(inode_map_offset);
+    *(uint64_t *)map_chunk->data.get() = 0;
+}
+
+void INodeTable::load_extensions() {
+    std::shared_ptr<Chunk> map_chunk = superblock->disk->get_chunk(inode_map_offset);
+    const uint64_t *map = (const uint64_t *)map_chunk->data.get();
+    if (map[0] > max_extensions) 
+        throw FileSystemException("INode table map is corrupt");
+
+    for (uint64_t ext = 0; ext < map[0]; ++ext) {
+        std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(superblock->disk, map[ext + 1], inodes_per_extension));
+        // the extensions are small, their counters are always recounted
+        bitmap->set_count = bitmap->count_set_bits();
+        extension_offsets.push_back(map[ext + 1]);
+        extension_inodes.push_back(std::move(bitmap));
+    }
+    extension_count.store(map[0], std::memory_order_release);
+}
+
+void INodeTable::initialize_groups_through(uint64_t idx) {
+    // extensions are initialized when they are added
+    if (idx < this->initialized_inodes() || idx >= inode_count) 
+        return ;
+
+    std::lock_guard<std::mutex> g(init_lock);
+    uint64_t group = initialized_groups.load();
+    for (; group <= idx / inodes_per_group && group < group_count; ++group) {
+        {
+            auto locks = used_inodes->lock_range(group * inodes_per_group, 1);
+            std::shared_ptr<Chunk> &chunk = used_inodes->chunks[group];
+            std::memset(chunk->data.get(), 0, chunk->size_bytes);
+        }
+
+        // groups are a whole number of ilist chunks
+        const uint64_t first_chunk = inode_ilist_offset + group * inodes_per_group / inodes_per_chunk;
+        const uint64_t last_inode = std::min(inode_count, (group + 1) * inodes_per_group);
+        const uint64_t end_chunk = inode_ilist_offset + (last_inode + inodes_per_chunk - 1) / inodes_per_chunk;
+        for (uint64_t chunk_idx = first_chunk; chunk_idx < end_chunk; ++chunk_idx) {
+            std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
+            std::memset(chunk->data.get(), 0, chunk->size_bytes);
+        }
+
+        // the padding after the last inode stays set so it is never handed out
+        if (group + 1 == group_count) {
+            for (uint64_t bit = inode_count; bit < inode_count + 8; ++bit) 
+                used_inodes->set(bit);
+        }
+        initialized_groups.store(group + 1, std::memory_order_release);
+    }
 }
 
-// returns the size of the entire table in chunks
+// returns the size of the table in chunks, not counting extensions
 uint64_t INodeTable::size_chunks() {
-    return used_inodes->size_chunks() + inode_count;
+    return used_inodes->size_chunks() + (inode_count + inodes_per_chunk - 1) / inodes_per_chunk + 1;
+}
+
+uint64_t INodeTable::used_inode_count() const {
+    uint64_t count = used_inodes->set_count.load();
+    const uint64_t extensions = extension_count.load(std::memory_order_acquire);
+    for (uint64_t ext = 0; ext < extensions; ++ext) 
+        count += extension_inodes[ext]->set_count.load();
+    return count;
+}
+
+DiskBitMap &INodeTable::bitmap_for(uint64_t idx, uint64_t &bit) {
+    if (idx < inode_count) {
+        bit = idx;
+        return *used_inodes;
+    }
+    bit = (idx - inode_count) % inodes_per_extension;
+    return *extension_inodes[(idx - inode_count) / inodes_per_extension];
+}
+
+bool INodeTable::in_use(uint64_t idx) {
+    // groups that were never initialized hold garbage
+    if (idx < inode_count && idx >= this->initialized_inodes()) 
+        return false;
+    uint64_t bit = 0;
+    return this->bitmap_for(idx, bit).get(bit);
+}
+
+uint64_t INodeTable::record_chunk(uint64_t idx, uint64_t &chunk_offset) const {
+    chunk_offset = idx % inodes_per_chunk;
+    if (idx < inode_count) 
+        return inode_ilist_offset + idx / inodes_per_chunk;
+
+    // extension records follow the extension's bitmap chunk
+    const uint64_t ext = (idx - inode_count) / inodes_per_extension;
+    const uint64_t ext_idx = (idx - inode_count) % inodes_per_extension;
+    chunk_offset = ext_idx % inodes_per_chunk;
+    return extension_offsets[ext] + 1 + ext_idx / inodes_per_chunk;
+}
+
+void INodeTable::grow(uint64_t seen_count) {
+    std::lock_guard<std::mutex> g(grow_lock);
+    const uint64_t extensions = extension_count.load();
+    if (extensions > seen_count) 
+        return ;
+    if (extensions == max_extensions) 
+        throw FileSystemException("No free inodes left");
+
+    // an extension is one contiguous run, a fragmented disk can have plenty of 
+    // free chunks and still not fit one
+    DiskBitMap::BitRange range;
+    try {
+        range = superblock->allocate_extent(EXTENSION_CHUNKS, EXTENSION_CHUNKS);
+    } catch (const FileSystemException &) {
+        throw FileSystemException("FileSystem out of space -- no contiguous run of " + 
+            std::to_string(EXTENSION_CHUNKS) + " chunks left to grow the inode table");
+    }
+
+    // like the table's own ilist, the records start out zeroed
+    for (uint64_t chunk_idx = range.start_idx + 1; chunk_idx < range.start_idx + EXTENSION_CHUNKS; ++chunk_idx) {
+        std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
+        std::memset(chunk->data.get(), 0, chunk->size_bytes);
+    }
+    std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(superblock->disk, range.start_idx, inodes_per_extension));
+    bitmap->clear_all();
+    extension_offsets.push_back(range.start_idx);
+    extension_inodes.push_back(std::move(bitmap));
+
+    std::shared_ptr<Chunk> map_chunk = superblock->disk->get_chunk(inode_map_offset);
+    uint64_t *map = (uint64_t *)map_chunk->data.get();
+    map[extensions + 1] = range.start_idx;
+    map[0] = extensions + 1;
+    extension_count.store(extensions + 1, std::memory_order_release);
 }
 
-INode INodeTable::get_inode(uint64_t idx) {
-    if (idx >= inode_count) 
+uint64_t INodeTable::allocate_inode(uint64_t parent_idx) {
+    uint64_t idx = 0;
+    bool claimed = false;
+
+    // an inode next to its parent shares the parent's inode table chunk
+    if (parent_idx != NO_PARENT && parent_idx < this->size_inodes() && 
+            (parent_idx >= inode_count || parent_idx < this->initialized_inodes())) {
+        uint64_t bit = 0;
+        DiskBitMap &bitmap = this->bitmap_for(parent_idx, bit);
+        const uint64_t chunk_start = bit - bit % inodes_per_chunk;
+        uint64_t hint = bit / 8;
+        claimed = bitmap.claim_unset_bit(idx, hint, chunk_start, chunk_start + inodes_per_chunk);
+        if (claimed) 
+            idx = parent_idx - bit + idx;
+    }
+    // only initialized groups are searched, the next group is initialized 
+    // when they are full. after the last one come the extensions
+    while (!claimed) {
+        const uint64_t initialized = this->initialized_inodes();
+        uint64_t hint = inode_alloc_hint.load(std::memory_order_relaxed);
+        claimed = used_inodes->claim_unset_bit(idx, hint, 0, initialized);
+        if (claimed) {
+            inode_alloc_hint.store(hint, std::memory_order_relaxed);
+        } else if (initialized < inode_count) {
+            this->initialize_groups_through(initialized);
+        } else {
+            const uint64_t extensions = extension_count.load(std::memory_order_acquire);
+            for (uint64_t ext = 0; ext < extensions && !claimed; ++ext) {
+                uint64_t ext_hint = 0;
+                claimed = extension_inodes[ext]->claim_unset_bit(idx, ext_hint, 0, inodes_per_extension);
+                if (claimed) 
+                    idx += inode_count + ext * inodes_per_extension;
+            }
+            if (!claimed) 
+                this->grow(extensions);
+        }
+    }
+
+    INode node;
+    node.superblock = superblock;
+    node.data.last_modified = time(nullptr);
+    this->set_inode(idx, node);
+    return idx;
+}
+
+std::shared_ptr<INode> INodeTable::get_inode(uint64_t idx) {
+    if (idx >= this->size_inodes()) 
         throw FileSystemException("INode index out of bounds");
-    if (!used_inodes->get(idx)) 
+    if (!this->in_use(idx)) 
         throw FileSystemException("INode at index is not currently in use. You can't have it.");
 
-    INode node;
-    uint64_t chunk_idx = idx / inodes_per_chunk;
-    uint64_t chunk_offset = idx % inodes_per_chunk;
-    std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
-    std::memcpy((void *)(&(node.data)), chunk->data.get() + sizeof(INode::INodeData) * chunk_offset, sizeof(INode::INodeData));
-    node.superblock = this->superblock;
+    std::lock_guard<std::mutex> g(inodecache_lock);
+    std::shared_ptr<INode> node = inodecache.get(idx);
+    if (node == nullptr) {
+        // an inode that could not be written back is newer than its record
+        std::lock_guard<std::mutex> wg(writeback_lock);
+        auto failed = writeback_failed.find(idx);
+        if (failed != writeback_failed.end()) {
+            node = std::shared_ptr<INode>(failed->second.release(), [this](INode *n) { this->release_inode(n); });
+            writeback_failed.erase(failed);
+            inodecache.put(idx, node);
+        }
+    }
+    if (node == nullptr) {
+        node = std::shared_ptr<INode>(new INode, [this](INode *n) { this->release_inode(n); });
+        uint64_t chunk_offset = 0;
+        uint64_t chunk_idx = this->record_chunk(idx, chunk_offset);
+        std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
+        node->data.decode(chunk->data.get() + INode::INodeData::RECORD_SIZE * chunk_offset);
+        node->superblock = this->superblock;
+        node->table = this;
+        node->idx = idx;
+        inodecache.put(idx, node);
+    }
+
+    // an inode already in the ring keeps its slot, a hot inode takes up one
+    const bool recent = node->recent_slot < recent_inodes.size() && recent_inodes[node->recent_slot] == node;
+    if (recent) 
+        return node;
+    if (recent_inodes.size() < RECENT_INODES) {
+        node->recent_slot = recent_inodes.size();
+        recent_inodes.push_back(node);
+    } else {
+        node->recent_slot = recent_inodes_next;
+        recent_inodes[recent_inodes_next] = node;
+        recent_inodes_next = (recent_inodes_next + 1) % RECENT_INODES;
+    }
     return node;
 }
 
 void INodeTable::set_inode(uint64_t idx, INode &node) {
-    if (idx >= inode_count) 
-        throw FileSystemException("INode index out of bounds");
-    used_inodes->set(idx);
+    std::vector<std::pair<uint64_t, INode *>> records(1, std::make_pair(idx, &node));
+    this->set_inodes(records);
+}
+
+void INodeTable::set_inodes(std::vector<std::pair<uint64_t, INode *>> &records) {
+    for (auto &record : records) {
+        if (record.first >= this->size_inodes()) 
+            throw FileSystemException("INode index out of bounds");
+    }
+
+    for (auto &record : records) {
+        this->initialize_groups_through(record.first);
+        record.second->flush();
+        record.second->store_extents();
 
-    uint64_t chunk_idx = idx / inodes_per_chunk;
-    uint64_t chunk_offset = idx % inodes_per_chunk;
-    std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
-    std::memcpy((void *)(chunk->data.get() + sizeof(INode::INodeData) * chunk_offset), (void *)(&(node.data)), sizeof(INode::INodeData));
+        std::shared_ptr<INode> loaded;
+        {
+            std::lock_guard<std::mutex> g(inodecache_lock);
+            loaded = inodecache.get(record.first);
+        }
+        if (loaded != nullptr && loaded.get() != record.second) {
+            loaded->data = record.second->data;
+            loaded->extents_loaded = false;
+            loaded->drop_mapping_cache();
+            loaded->dirty = false;
+        }
+    }
+    // the records are in place before their inodes are marked used
+    this->write_records(records);
+    for (auto &record : records) {
+        uint64_t bit = 0;
+        this->bitmap_for(record.first, bit).set(bit);
+    }
+}
+
+void INodeTable::write_inode(INode &node) {
+    std::vector<std::pair<uint64_t, INode *>> records(1, std::make_pair(node.idx, &node));
+    this->write_records(records);
+}
+
+void INodeTable::write_records(std::vector<std::pair<uint64_t, INode *>> &records) {
+    // buffered chunks are placed first, the record has to point at them
+    for (auto &record : records) {
+        record.second->flush();
+        record.second->store_extents();
+    }
+
+    // each inode table chunk is fetched once for all of its records
+    std::sort(records.begin(), records.end(), 
+        [](const std::pair<uint64_t, INode *> &a, const std::pair<uint64_t, INode *> &b) { return a.first < b.first; });
+    std::shared_ptr<Chunk> chunk;
+    for (auto &record : records) {
+        uint64_t chunk_offset = 0;
+        const uint64_t chunk_idx = this->record_chunk(record.first, chunk_offset);
+        if (chunk == nullptr || chunk->chunk_idx != chunk_idx) 
+            chunk = superblock->disk->get_chunk(chunk_idx);
+        record.second->data.encode(chunk->data.get() + INode::INodeData::RECORD_SIZE * chunk_offset);
+        record.second->dirty = false;
+    }
+}
+
+void INodeTable::release_inode(INode *node) {
+    std::unique_ptr<INode> owned(node);
+    if (node->table == nullptr || (!node->dirty && node->delalloc_chunks.empty())) 
+        return ;
+
+    // this runs when the last reference is dropped, so nothing may escape it
+    try {
+        this->write_inode(*node);
+    } catch (...) {
+        node->dirty = true;
+        std::lock_guard<std::mutex> g(writeback_lock);
+        writeback_failed[node->idx] = std::move(owned);
+    }
+}
+
+void INodeTable::sync_inodes() {
+    {
+        // the ones that failed before are retried first, they stay if they fail again
+        std::lock_guard<std::mutex> g(writeback_lock);
+        for (auto it = writeback_failed.begin(); it != writeback_failed.end(); ) {
+            this->write_inode(*it->second);
+            it = writeback_failed.erase(it);
+        }
+    }
+
+    std::vector<std::shared_ptr<INode>> loaded;
+    {
+        std::lock_guard<std::mutex> g(inodecache_lock);
+        inodecache.for_each([&](uint64_t, std::shared_ptr<INode> &node) {
+            if (node->dirty || !node->delalloc_chunks.empty()) 
+                loaded.push_back(node);
+        });
+    }
+
+    std::vector<std::pair<uint64_t, INode *>> records;
+    for (std::shared_ptr<INode> &node : loaded) 
+        records.push_back(std::make_pair(node->idx, node.get()));
+    this->write_records(records);
 }
 
-void INodeTable::free_inode(uint64_t idx) {
-    if (idx >= inode_count) 
+void INodeTable::free_inode(uint64_t idx, bool defer) {
+    if (idx >= this->size_inodes()) 
         throw FileSystemException("INode index out of bounds");
-    used_inodes->clr(idx);
+
+    // the inode leaves the cache, whoever still holds it has a detached copy
+    // that is never written back
+    std::shared_ptr<INode> node = this->get_inode(idx);
+    {
+        std::lock_guard<std::mutex> g(inodecache_lock);
+        inodecache.erase(idx);
+        if (node->recent_slot < recent_inodes.size() && recent_inodes[node->recent_slot] == node) 
+            recent_inodes[node->recent_slot].reset();
+    }
+    node->table = nullptr;
+    uint64_t chunk_offset = 0;
+    std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(this->record_chunk(idx, chunk_offset));
+    std::memset(chunk->data.get() + INode::INodeData::RECORD_SIZE * chunk_offset, 0, INode::INodeData::RECORD_SIZE);
+    uint64_t bit = 0;
+    this->bitmap_for(idx, bit).clr(bit);
+    if (!defer) {
+        node->truncate(0);
+        node->store_extents();
+        return ;
+    }
+
+    // the detached copy is now the only thing that knows the file's chunks
+    std::lock_guard<std::mutex> g(reclaim_lock);
+    if (!reclaimer.joinable()) 
+        reclaimer = std::thread(&INodeTable::reclaim_loop, this);
+    reclaim_queue.push_back(std::move(node));
+    reclaim_cv.notify_all();
+}
+
+void INodeTable::drain_reclaimer() {
+    std::unique_lock<std::mutex> g(reclaim_lock);
+    reclaim_cv.wait(g, [this]() { return reclaim_queue.empty() && reclaims_running == 0; });
+}
+
+void INodeTable::reclaim_loop() {
+    std::unique_lock<std::mutex> g(reclaim_lock);
+    while (true) {
+        reclaim_cv.wait(g, [this]() { return reclaimer_stop || !reclaim_queue.empty(); });
+        if (reclaim_queue.empty()) 
+            return ;
+
+        std::shared_ptr<INode> node = std::move(reclaim_queue.front());
+        reclaim_queue.pop_front();
+        reclaims_running++;
+        g.unlock();
+        node->truncate(0);
+        node->store_extents();
+        node.reset();
+        g.lock();
+        reclaims_running--;
+        reclaim_cv.notify_all();
+    }
+}
+
+INodeTable::~INodeTable() {
+    // whatever can not be written back by now is lost
+    try {
+        this->sync_inodes();
+    } catch (...) {
+    }
+    recent_inodes.clear();
+
+    // whatever is still queued is freed before the table goes away
+    {
+        std::lock_guard<std::mutex> g(reclaim_lock);
+        reclaimer_stop = true;
+        reclaim_cv.notify_all();
+    }
+    if (reclaimer.joinable()) 
+        reclaimer.join();
 }
 
 SuperBlock::SuperBlock(Disk *disk) 
     : disk(disk), disk_size_bytes(disk->size_bytes()), 
     disk_size_chunks(disk->size_chunks()),
-    disk_chunk_size(disk->chunk_size()) {
+    disk_chunk_size(disk->chunk_size()), reserved_chunks(0) {
+}
+
+void SuperBlock::reserve_chunks(uint64_t chunk_count) {
+    this->reserve_chunks_up_to(chunk_count, chunk_count);
+}
+
+uint64_t SuperBlock::reserve_chunks_up_to(uint64_t min_count, uint64_t max_count) {
+    uint64_t reserved = reserved_chunks.load();
+    uint64_t count = 0;
+    do {
+        const uint64_t free_chunks = disk_block_map->unset_count();
+        const uint64_t available = free_chunks > reserved ? free_chunks - reserved : 0;
+        if (available < min_count) 
+            throw FileSystemException("FileSystem out of space -- unable to reserve chunks");
+        count = std::min(available, max_count);
+    } while (!reserved_chunks.compare_exchange_weak(reserved, reserved + count));
+    return count;
 }
 
-void SuperBlock::init(double inode_table_size_rel_to_disk) {
+uint64_t SuperBlock::hold_for_allocation(uint64_t min_count, uint64_t max_count, const uint64_t *reservation, uint64_t &held) {
+    const uint64_t drawn = reservation != nullptr ? *reservation : 0;
+    held = this->reserve_chunks_up_to(min_count > drawn ? min_count - drawn : 0, max_count > drawn ? max_count - drawn : 0);
+    return std::min(max_count, drawn + held);
+}
+
+void SuperBlock::settle_allocation(uint64_t chunk_count, uint64_t *reservation, uint64_t held) {
+    // the chunks are now marked used, so what held them back can go
+    uint64_t drawn = 0;
+    if (reservation != nullptr) {
+        drawn = std::min(*reservation, chunk_count);
+        *reservation -= drawn;
+    }
+    this->release_chunks(drawn + held);
+}
+
+void SuperBlock::release_chunks(uint64_t chunk_count) {
+    reserved_chunks -= chunk_count;
+}
+
+SuperBlock::~SuperBlock() {
+    // deferred frees have to be done before the usage counters are written
+    if (inode_table) {
+        inode_table->drain_reclaimer();
+        try {
+            inode_table->sync_inodes();
+        } catch (...) {
+        }
+    }
+    if (mounted) 
+        write_superblock(true);
+}
+
+void SuperBlock::init(double inode_table_size_rel_to_disk, AllocatorType allocator) {
     //requested size of things in chunks
     inode_table_size_chunks = inode_table_size_rel_to_disk * disk_size_chunks;
-    
-    std::cout << "Offset " << inode_table_offset << std::endl;
-
-    std::cout << "disk block map size in chunks is " << disk_block_map_size_chunks << std::endl;
-    std::cout << "inode table size in chunks is " << inode_table_size_chunks << std::endl;
 
     //block map init
-    std::cout << "BEGIN INITIALIZE BLOCK MAP" << std::endl;
     disk_block_map_offset = superblock_size_chunks; 
     disk_block_map = std::unique_ptr<DiskBitMap>(new DiskBitMap(disk, disk_block_map_offset, disk->size_chunks()));
     disk_block_map->clear_all();
     disk_block_map_size_chunks = disk_block_map->size_chunks();
-    std::cout << "FINISHED INITIALIZE BLOCK MAP" << std::endl;
-    //get actual size of the block map made
 
     //check that metadata isn't too big
-    if(disk_block_map_size_chunks + inode_table_size_chunks + disk_block_map_size_chunks >= disk_size_chunks) {
-        throw new FileSystemException("Requested size of superblock, inode table, and bit map exceeds size of disk");
+    if(superblock_size_chunks + disk_block_map_size_chunks + inode_table_size_chunks >= disk_size_chunks) {
+        throw FileSystemException("Requested size of superblock, inode table, and bit map exceeds size of disk");
     }
 
     //create inode table
@@ -204,18 +1511,118 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
     //free space
     data_offset = superblock_size_chunks + disk_block_map_size_chunks + inode_table_size_chunks;
 
+    //the buddy allocator's free maps come out of the front of the data area
+    allocator_type = allocator;
+    if (allocator_type == AllocatorType::BUDDY) {
+        buddy_offset = data_offset;
+        data_offset += BuddyAllocator::metadata_chunks_for(disk_chunk_size, disk_size_chunks - data_offset);
+        if (data_offset >= disk_size_chunks) {
+            throw FileSystemException("Buddy allocator metadata exceeds size of disk");
+        }
+        buddy = std::unique_ptr<BuddyAllocator>(new BuddyAllocator(this, buddy_offset, data_offset, disk_size_chunks - data_offset));
+    }
+
     //set all metadata chunk bits to `used'
-    for(uint64_t bit_i = 0; bit_i < disk_block_map_size_chunks + disk_block_map_size_chunks + inode_table_size_chunks; ++bit_i) {
+    for(uint64_t bit_i = 0; bit_i < data_offset; ++bit_i) {
         disk_block_map->set(bit_i);
     }
 
-    std::cout << "What's new guys?" << std::endl;
+    //the data area starts out as a single free extent
+    if (allocator_type == AllocatorType::BUDDY) {
+        buddy->format();
+    } else {
+        build_allocation_groups();
+    }
+
+    mounted = true;
+    write_superblock(false);
+}
 
+void SuperBlock::load_from_disk(Disk * disk) {
+    auto sb_chunk = disk->get_chunk(0);
+    auto sb_data = sb_chunk->data.get();
+    int offset = 0;
+    //superblock_size_chunks = *(uint64_t *)(sb_data + offset);
+    offset += sizeof(uint64_t);
+    //disk_size_bytes = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    //disk_size_chunks = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    //disk_chunk_size = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    disk_block_map_offset = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    disk_block_map_size_chunks = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    inode_table_offset = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    inode_table_size_chunks = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    data_offset = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    allocator_type = (AllocatorType)*(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    buddy_offset = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    allocation_group_size_chunks = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    uint64_t clean = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    uint64_t used_chunks = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    uint64_t used_inodes = *(uint64_t *)(sb_data+offset);
+    offset += sizeof(uint64_t);
+    uint64_t initialized_inode_groups = *(uint64_t *)(sb_data+offset);
+    sb_chunk = nullptr;
     
+    // the bitmaps are already on disk, so they are attached to without being cleared
+    disk_block_map = std::unique_ptr<DiskBitMap>(new DiskBitMap(disk, disk_block_map_offset, disk_size_chunks));
+    inode_table = std::unique_ptr<INodeTable>(new INodeTable(this, inode_table_offset, inode_table_size_chunks));
+    inode_table->initialized_groups = initialized_inode_groups;
+    inode_table->load_extensions();
+
+    // the usage counters are only trusted if the file system was unmounted cleanly
+    if (clean) {
+        disk_block_map->set_count = used_chunks;
+        inode_table->used_inodes->set_count = used_inodes;
+    } else {
+        disk_block_map->set_count = disk_block_map->count_set_bits();
+        inode_table->used_inodes->set_count = inode_table->used_inodes->count_set_bits(inode_table->initialized_inodes());
+    }
+
+    if (allocator_type == AllocatorType::BUDDY) {
+        buddy = std::unique_ptr<BuddyAllocator>(new BuddyAllocator(this, buddy_offset, data_offset, disk_size_chunks - data_offset));
+        buddy->load();
+    } else {
+        build_allocation_groups();
+    }
+
+    mounted = true;
+    write_superblock(false);
+}
+
+void SuperBlock::sync() {
+    if (inode_table) 
+        inode_table->sync_inodes();
+    if (mounted) 
+        write_superblock(false);
+}
+
+FileSystemStats SuperBlock::statfs() const {
+    FileSystemStats stats;
+    stats.chunk_size = disk_chunk_size;
+    stats.total_chunks = disk_size_chunks;
+    stats.free_chunks = disk_block_map->unset_count() - std::min(reserved_chunks.load(), disk_block_map->unset_count());
+    stats.total_inodes = inode_table->size_inodes();
+    stats.free_inodes = stats.total_inodes - inode_table->used_inode_count();
+    return stats;
+}
 
-    //serialize to disk
+// clean records that the usage counters written along with everything else are 
+// exact, it is only set when unmounting
+void SuperBlock::write_superblock(bool clean) {
     if(superblock_size_chunks != 1) {
-        throw new FileSystemException("superblock size > 1 chunk not supported!");
+        throw FileSystemException("superblock size > 1 chunk not supported!");
     }
     auto sb_chunk = disk->get_chunk(0);
     auto sb_data = sb_chunk->data.get();
@@ -237,32 +1644,412 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
     *(uint64_t *)(sb_data+offset) = inode_table_size_chunks;
     offset += sizeof(uint64_t);
     *(uint64_t *)(sb_data+offset) = data_offset;
-}
-
-void SuperBlock::load_from_disk(Disk * disk) {
-    auto sb_chunk = disk->get_chunk(0);
-    auto sb_data = sb_chunk->data.get();
-    int offset = 0;
-    //superblock_size_chunks = *(uint64_t *)(sb_data + offset);
     offset += sizeof(uint64_t);
-    //disk_size_bytes = *(uint64_t *)(sb_data+offset);
+    *(uint64_t *)(sb_data+offset) = (uint64_t)allocator_type;
     offset += sizeof(uint64_t);
-    //disk_size_chunks = *(uint64_t *)(sb_data+offset);
+    *(uint64_t *)(sb_data+offset) = buddy_offset;
     offset += sizeof(uint64_t);
-    //disk_chunk_size = *(uint64_t *)(sb_data+offset);
+    *(uint64_t *)(sb_data+offset) = allocation_group_size_chunks;
     offset += sizeof(uint64_t);
-    disk_block_map_offset = *(uint64_t *)(sb_data+offset);
+    *(uint64_t *)(sb_data+offset) = clean ? 1 : 0;
     offset += sizeof(uint64_t);
-    disk_block_map_size_chunks = *(uint64_t *)(sb_data+offset);
-    offset += sizeof(uint64_t);
-    inode_table_offset = *(uint64_t *)(sb_data+offset);
+    *(uint64_t *)(sb_data+offset) = disk_block_map->set_count.load();
     offset += sizeof(uint64_t);
-    inode_table_size_chunks = *(uint64_t *)(sb_data+offset);
+    *(uint64_t *)(sb_data+offset) = inode_table->used_inodes->set_count.load();
     offset += sizeof(uint64_t);
-    data_offset = *(uint64_t *)(sb_data+offset);
-    
-    //TODO: Deserialize these properly
-    //disk_block_map = std::unique_ptr<DiskBitMap>(new DiskBitMap(disk, disk_block_map_offset, disk_block_map_size_chunks));
-    //inode_table = std::unique_ptr<INodeTable>(new INodeTable(this, ));
+    *(uint64_t *)(sb_data+offset) = inode_table->initialized_groups.load();
+}
+
+void SuperBlock::build_allocation_groups() {
+    if (allocation_group_size_chunks == 0 || allocation_group_size_chunks % 64 != 0) 
+        throw FileSystemException("Allocation group size must be a non zero multiple of 64 chunks");
+
+    // the first group is widened down to a byte boundary, the bits it picks up 
+    // belong to metadata chunks and are always set
+    allocation_groups.clear();
+    for (uint64_t start = data_offset / allocation_group_size_chunks * allocation_group_size_chunks; 
+        start < disk_size_chunks; start += allocation_group_size_chunks) {
+        std::unique_ptr<AllocationGroup> group(new AllocationGroup);
+        group->start_chunk = start < data_offset ? data_offset / 8 * 8 : start;
+        group->end_chunk = std::min(start + allocation_group_size_chunks, disk_size_chunks);
+        group->alloc_hint = group->start_chunk / 8;
+        // the index is built a byte at a time and counts the free chunks as well
+        group->free_extents.build(*disk_block_map, std::max(group->start_chunk, data_offset), group->end_chunk);
+        group->free_chunks = group->free_extents.free_count();
+        allocation_groups.push_back(std::move(group));
+    }
+}
+
+size_t SuperBlock::group_index_for_chunk(uint64_t chunk_idx) const {
+    const uint64_t first = allocation_groups.front()->start_chunk / allocation_group_size_chunks;
+    uint64_t group_idx = chunk_idx / allocation_group_size_chunks;
+    group_idx = group_idx < first ? 0 : group_idx - first;
+    return std::min(group_idx, (uint64_t)allocation_groups.size() - 1);
+}
+
+size_t SuperBlock::group_index_for_thread() const {
+    const size_t thread_hash = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return thread_hash % allocation_groups.size();
+}
+
+std::shared_ptr<Chunk> SuperBlock::allocate_chunk(uint64_t goal, uint64_t *reservation) {
+    uint64_t held = 0;
+    this->hold_for_allocation(1, 1, reservation, held);
+    std::shared_ptr<Chunk> chunk;
+    try {
+        chunk = this->find_chunk(goal);
+    } catch (...) {
+        this->release_chunks(held);
+        throw;
+    }
+    this->settle_allocation(1, reservation, held);
+    return chunk;
+}
+
+std::shared_ptr<Chunk> SuperBlock::find_chunk(uint64_t goal) {
+    if (allocator_type == AllocatorType::BUDDY) {
+        std::lock_guard<std::mutex> g(buddy_lock);
+        return this->disk->get_chunk(buddy->allocate(0).start_idx);
+    }
+
+    // start with the preferred group and move on through the others until one 
+    // has a free chunk. the chunk is claimed with a compare and swap on the block 
+    // map, so no group lock is taken
+    const size_t first = goal != 0 ? group_index_for_chunk(goal) : group_index_for_thread();
+    for (uint64_t i = 0; i < allocation_groups.size(); ++i) {
+        AllocationGroup &group = *allocation_groups[(first + i) % allocation_groups.size()];
+        if (group.free_chunks.load() == 0) 
+            continue;
+
+        uint64_t chunk_idx = 0;
+        uint64_t hint = group.alloc_hint.load(std::memory_order_relaxed);
+        if (!this->disk_block_map->claim_unset_bit(chunk_idx, hint, group.start_chunk, group.end_chunk)) 
+            continue;
+        group.alloc_hint.store(hint, std::memory_order_relaxed);
+        group.free_chunks--;
+
+        // only this group's index is touched
+        {
+            std::lock_guard<std::mutex> g(group.lock);
+            group.free_extents.remove(chunk_idx, 1);
+        }
+        return this->disk->get_chunk(chunk_idx);
+    }
+
+    throw FileSystemException("FileSystem out of space -- unable to allocate a new chunk");
+}
+
+void SuperBlock::free_chunk(uint64_t chunk_idx) {
+    this->free_extent(chunk_idx, 1);
+}
+
+DiskBitMap::BitRange SuperBlock::allocate_extent(uint64_t min_chunks, uint64_t preferred_chunks, uint64_t goal, 
+    uint64_t *reservation) {
+    if (min_chunks == 0 || preferred_chunks < min_chunks) 
+        throw FileSystemException("Invalid extent size requested");
+
+    // the run is cut down to the room there is outside of other reservations. 
+    // the buddy allocator can not go below min_chunks rounded to a power of two
+    uint64_t min_room = min_chunks;
+    if (allocator_type == AllocatorType::BUDDY) 
+        min_room = 1ull << BuddyAllocator::order_for(min_chunks);
+    uint64_t held = 0;
+    const uint64_t room = this->hold_for_allocation(min_room, std::max(preferred_chunks, min_room), reservation, held);
+    DiskBitMap::BitRange range;
+    try {
+        range = this->find_extent(min_chunks, room, goal);
+    } catch (...) {
+        this->release_chunks(held);
+        throw;
+    }
+    this->settle_allocation(range.bit_count, reservation, held);
+    return range;
+}
+
+DiskBitMap::BitRange SuperBlock::find_extent(uint64_t min_chunks, uint64_t preferred_chunks, uint64_t goal) {
+    if (allocator_type == AllocatorType::BUDDY) {
+        // the largest power of two that does not exceed preferred_chunks, unless 
+        // that is too small to satisfy min_chunks
+        uint64_t order = BuddyAllocator::order_for(preferred_chunks);
+        if ((1ull << order) > preferred_chunks && (1ull << (order - 1)) >= min_chunks) 
+            order--;
+
+        const uint64_t min_order = BuddyAllocator::order_for(min_chunks);
+        std::lock_guard<std::mutex> g(buddy_lock);
+        while (true) {
+            try {
+                return buddy->allocate(order);
+            } catch (const FileSystemException &e) {
+                if (order <= min_order) 
+                    throw;
+                order--;
+            }
+        }
+    }
+
+    const size_t first = goal != 0 ? group_index_for_chunk(goal) : group_index_for_thread();
+    while (true) {
+        // the first group with a run that fits preferred_chunks wins
+        bool collided = false;
+        for (uint64_t i = 0; i < allocation_groups.size(); ++i) {
+            AllocationGroup &group = *allocation_groups[(first + i) % allocation_groups.size()];
+            if (group.free_chunks.load() < min_chunks) 
+                continue;
+
+            std::lock_guard<std::mutex> g(group.lock);
+            DiskBitMap::BitRange range;
+            if (goal != 0 && i == 0) {
+                range = group.free_extents.near_fit(preferred_chunks, goal);
+            } else {
+                range = group.free_extents.best_fit(preferred_chunks);
+            }
+            if (range.bit_count == 0) 
+                continue;
+            if (this->claim_group_range(group, range)) 
+                return range;
+            collided = true;
+        }
+        if (collided) 
+            continue;
+
+        // nothing can hold the preferred size, settle for the biggest run there 
+        // is, from the preferred group on a tie
+        AllocationGroup *largest_group = nullptr;
+        uint64_t largest = 0;
+        for (uint64_t i = 0; i < allocation_groups.size(); ++i) {
+            AllocationGroup &group = *allocation_groups[(first + i) % allocation_groups.size()];
+            std::lock_guard<std::mutex> g(group.lock);
+            const uint64_t length = group.free_extents.largest().bit_count;
+            if (length > largest) {
+                largest = length;
+                largest_group = &group;
+            }
+        }
+        if (largest < min_chunks) 
+            throw FileSystemException("FileSystem out of space -- unable to allocate a contiguous extent");
+
+        std::lock_guard<std::mutex> g(largest_group->lock);
+        DiskBitMap::BitRange range = largest_group->free_extents.largest();
+        range.bit_count = std::min(range.bit_count, preferred_chunks);
+        if (range.bit_count >= min_chunks && this->claim_group_range(*largest_group, range)) 
+            return range;
+    }
+}
+
+bool SuperBlock::claim_group_range(AllocationGroup &group, const DiskBitMap::BitRange &range) {
+    // a lock free allocation can claim a chunk before it leaves the index, so 
+    // every bit is claimed atomically and the run is given back on a collision
+    uint64_t claimed = 0;
+    while (claimed < range.bit_count && !this->disk_block_map->atomic_set(range.start_idx + claimed)) 
+        claimed++;
+    if (claimed < range.bit_count) {
+        for (uint64_t idx = range.start_idx; idx < range.start_idx + claimed; ++idx) 
+            this->disk_block_map->atomic_clr(idx);
+        return false;
+    }
+
+    group.free_extents.remove(range.start_idx, range.bit_count);
+    group.free_chunks -= range.bit_count;
+    return true;
+}
+
+std::vector<std::unique_lock<std::mutex>> SuperBlock::lock_groups(uint64_t start_chunk, uint64_t chunk_count) {
+    // groups are locked in ascending order, so this can not deadlock with itself
+    std::vector<std::unique_lock<std::mutex>> locks;
+    AllocationGroup *last = nullptr;
+    for (uint64_t idx = start_chunk; idx < start_chunk + chunk_count; ) {
+        AllocationGroup &group = *allocation_groups[group_index_for_chunk(idx)];
+        if (&group != last) {
+            locks.push_back(std::unique_lock<std::mutex>(group.lock));
+            last = &group;
+        }
+        idx = group.end_chunk > idx ? group.end_chunk : idx + 1;
+    }
+    return locks;
+}
+
+void SuperBlock::adjust_group_free_chunks(uint64_t start_chunk, uint64_t chunk_count, bool freed) {
+    for (uint64_t idx = start_chunk; idx < start_chunk + chunk_count; ) {
+        AllocationGroup &group = *allocation_groups[group_index_for_chunk(idx)];
+        const uint64_t end = std::min(group.end_chunk, start_chunk + chunk_count);
+        if (freed) {
+            group.free_chunks += end - idx;
+        } else {
+            group.free_chunks -= end - idx;
+        }
+        idx = end;
+    }
 }
 
+void SuperBlock::free_extent(uint64_t start_chunk, uint64_t chunk_count) {
+    if (start_chunk < data_offset || start_chunk + chunk_count > disk_size_chunks) 
+        throw FileSystemException("Freeing a chunk outside of the data area");
+
+    if (allocator_type == AllocatorType::BUDDY) {
+        std::lock_guard<std::mutex> g(buddy_lock);
+        for (uint64_t idx = start_chunk; idx < start_chunk + chunk_count; ++idx) {
+            if (!this->disk_block_map->get(idx)) 
+                throw FileSystemException("Freeing a chunk that is not allocated");
+        }
+
+        // arbitrary runs are freed as the largest aligned blocks they contain,
+        // which merge back with their buddies as usual
+        uint64_t idx = start_chunk;
+        while (idx < start_chunk + chunk_count) {
+            uint64_t order = 0;
+            while (order < buddy->max_order && ((idx - buddy->base_chunk) & (1ull << order)) == 0 && 
+                    idx + (2ull << order) <= start_chunk + chunk_count) 
+                order++;
+            buddy->free(idx, order);
+            idx += 1ull << order;
+        }
+        return ;
+    }
+
+    std::vector<std::unique_lock<std::mutex>> group_locks = lock_groups(start_chunk, chunk_count);
+    for (uint64_t idx = start_chunk; idx < start_chunk + chunk_count; ++idx) {
+        if (!this->disk_block_map->atomic_get(idx)) 
+            throw FileSystemException("Freeing a chunk that is not allocated");
+    }
+
+    // the run goes into the indexes before its bits are cleared, so a lock free 
+    // allocation can never claim a chunk that the index does not know is free
+    adjust_group_free_chunks(start_chunk, chunk_count, true);
+    for (uint64_t idx = start_chunk; idx < start_chunk + chunk_count; ) {
+        AllocationGroup &group = *allocation_groups[group_index_for_chunk(idx)];
+        const uint64_t end = std::min(group.end_chunk, start_chunk + chunk_count);
+        group.free_extents.insert(idx, end - idx);
+        idx = end;
+    }
+    for (uint64_t idx = start_chunk; idx < start_chunk + chunk_count; ++idx) {
+        this->disk_block_map->atomic_clr(idx);
+    }
+}
+
+BuddyAllocator::BuddyAllocator(SuperBlock *superblock, uint64_t metadata_offset, uint64_t base_chunk, uint64_t size_chunks) 
+    : superblock(superblock), metadata_offset(metadata_offset), base_chunk(base_chunk), size_chunks(size_chunks) {
+    max_order = 0;
+    while ((2ull << max_order) <= size_chunks) 
+        max_order++;
+
+    // one free map per order, laid out back to back
+    uint64_t chunk_idx = metadata_offset;
+    for (uint64_t order = 0; order <= max_order; ++order) {
+        free_maps.push_back(std::unique_ptr<DiskBitMap>(
+            new DiskBitMap(superblock->disk, chunk_idx, size_chunks >> order)));
+        chunk_idx += free_maps.back()->size_chunks();
+    }
+    free_lists.resize(max_order + 1);
+}
+
+uint64_t BuddyAllocator::metadata_chunks_for(uint64_t chunk_size, uint64_t size_chunks) {
+    uint64_t chunks = 0;
+    for (uint64_t order = 0; (1ull << order) <= size_chunks; ++order) {
+        chunks += DiskBitMap::size_chunks_for(chunk_size, size_chunks >> order);
+    }
+    return chunks;
+}
+
+uint64_t BuddyAllocator::order_for(uint64_t chunk_count) {
+    uint64_t order = 0;
+    while ((1ull << order) < chunk_count) 
+        order++;
+    return order;
+}
+
+void BuddyAllocator::format() {
+    for (uint64_t order = 0; order <= max_order; ++order) {
+        free_maps[order]->clear_all();
+        free_lists[order].clear();
+    }
+
+    // cover the managed chunks with the largest naturally aligned blocks that fit
+    uint64_t offset = 0;
+    while (offset < size_chunks) {
+        uint64_t order = max_order;
+        while ((offset & ((1ull << order) - 1)) != 0 || offset + (1ull << order) > size_chunks) 
+            order--;
+        push_block(offset, order);
+        offset += 1ull << order;
+    }
+}
+
+void BuddyAllocator::load() {
+    for (uint64_t order = 0; order <= max_order; ++order) {
+        free_lists[order].clear();
+        const DiskBitMap &map = *free_maps[order];
+        for (uint64_t idx = 0; idx < map.size_in_bits; ++idx) {
+            // skip whole bytes with no free blocks in them
+            if (idx % 8 == 0 && map.load_byte_for_idx(idx) == 0) {
+                idx += 7;
+                continue ;
+            }
+            if (map.get(idx)) 
+                free_lists[order].insert(idx << order);
+        }
+    }
+}
+
+DiskBitMap::BitRange BuddyAllocator::allocate(uint64_t order) {
+    if (order > max_order) 
+        throw FileSystemException("FileSystem out of space -- requested buddy block is larger than the disk");
+
+    // find the smallest free block that is big enough, then split it down
+    uint64_t found = order;
+    while (found <= max_order && free_lists[found].empty()) 
+        found++;
+    if (found > max_order) 
+        throw FileSystemException("FileSystem out of space -- unable to allocate a buddy block");
+
+    const uint64_t offset = *free_lists[found].begin();
+    pop_block(offset, found);
+    while (found > order) {
+        found--;
+        push_block(offset + (1ull << found), found);
+    }
+
+    DiskBitMap::BitRange range;
+    range.start_idx = base_chunk + offset;
+    range.bit_count = 1ull << order;
+    range.set_range(*superblock->disk_block_map);
+    return range;
+}
+
+void BuddyAllocator::free(uint64_t start_chunk, uint64_t order) {
+    if (start_chunk < base_chunk || start_chunk + (1ull << order) > base_chunk + size_chunks) 
+        throw FileSystemException("Freeing a buddy block outside of the managed area");
+
+    uint64_t offset = start_chunk - base_chunk;
+    if ((offset & ((1ull << order) - 1)) != 0) 
+        throw FileSystemException("Freeing a buddy block that is not aligned to its size");
+    for (uint64_t idx = start_chunk; idx < start_chunk + (1ull << order); ++idx) {
+        if (!superblock->disk_block_map->get(idx)) 
+            throw FileSystemException("Freeing a chunk that is not allocated");
+    }
+
+    DiskBitMap::BitRange range;
+    range.start_idx = start_chunk;
+    range.bit_count = 1ull << order;
+    range.clr_range(*superblock->disk_block_map);
+
+    // merge with the buddy for as long as it is free as well
+    while (order < max_order) {
+        const uint64_t buddy_offset = offset ^ (1ull << order);
+        if (free_lists[order].count(buddy_offset) == 0) 
+            break;
+        pop_block(buddy_offset, order);
+        offset &= ~(1ull << order);
+        order++;
+    }
+    push_block(offset, order);
+}
+
+void BuddyAllocator::push_block(uint64_t offset, uint64_t order) {
+    free_lists[order].insert(offset);
+    free_maps[order]->set(offset >> order);
+}
+
+void BuddyAllocator::pop_block(uint64_t offset, uint64_t order) {
+    free_lists[order].erase(offset);
+    free_maps[order]->clr(offset >> order);
+}
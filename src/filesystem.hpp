@@ -4,7 +4,16 @@
 #include <bitset>
 #include <array>
 #include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <algorithm>
 #include <cstdint>
 
 #include "diskinterface.hpp"
@@ -15,12 +24,47 @@ struct FileSystem;
 struct INode;
 struct INodeTable;
 struct SuperBlock;
+struct BuddyAllocator;
 
 struct FileSystemException : public std::exception {
 	std::string message;
 	FileSystemException(const std::string &message) : message(message) { };
 };
 
+// which allocator hands out chunks from the data area, chosen at SuperBlock::init
+enum class AllocatorType : uint64_t {
+	BITMAP = 0, // first/best fit over the disk block map and free extent index
+	BUDDY = 1, // power of two runs from a buddy system layered over the disk block map
+};
+
+/*
+	A slice of the data area with its own lock, next-fit cursor, free counter and
+	free extent index. threads (and files, through their allocation goal) prefer
+	a group of their own, so concurrent writers mostly allocate without 
+	contending with each other. single chunks are claimed lock free, the lock 
+	guards the index. runs never span groups. groups are aligned to 64 chunks 
+	so no two groups share a word of the block map
+*/
+struct AllocationGroup {
+	std::mutex lock;
+	uint64_t start_chunk = 0; // first chunk of the group's segment of the block map
+	uint64_t end_chunk = 0; // one past the last chunk of the segment
+	std::atomic<uint64_t> free_chunks;
+	std::atomic<uint64_t> alloc_hint; // next-fit cursor into the block map
+	FreeExtentTree free_extents; // the group's free extents, rebuilt at mount
+
+	AllocationGroup() : free_chunks(0), alloc_hint(0) { }
+};
+
+// a snapshot of how full the file system is, see SuperBlock::statfs
+struct FileSystemStats {
+	uint64_t chunk_size = 0;
+	uint64_t total_chunks = 0;
+	uint64_t free_chunks = 0;
+	uint64_t total_inodes = 0;
+	uint64_t free_inodes = 0;
+};
+
 struct SuperBlock {
 	Disk *disk;
     const uint64_t superblock_size_chunks = 1;
@@ -32,28 +76,120 @@ struct SuperBlock {
     uint64_t disk_block_map_size_chunks; // number of chunks in disk block map
 	std::unique_ptr<DiskBitMap> disk_block_map;
 
+	// the data area is split into allocation groups of this many chunks, set 
+	// before init to change it. a multiple of 64. the buddy allocator has none
+	uint64_t allocation_group_size_chunks = 8192;
+	std::vector<std::unique_ptr<AllocationGroup>> allocation_groups;
+
+	AllocatorType allocator_type = AllocatorType::BITMAP;
+	uint64_t buddy_offset = 0; // chunk in which the buddy allocator's free maps start
+	std::unique_ptr<BuddyAllocator> buddy;
+	std::mutex buddy_lock;
+
+    uint64_t data_offset; //where free chunks begin
+	std::atomic<uint64_t> reserved_chunks; // promised to delayed allocations, not yet allocated
+
+	// declared after the allocators, so that it is destroyed (and writes its 
+	// inodes back, which may allocate) while they are still around
 	uint64_t inode_table_offset; // chunk in which the inode table starts
 	uint64_t inode_table_size_chunks; // number of chunks in the inode table
 	std::unique_ptr<INodeTable> inode_table;
-
-    uint64_t data_offset; //where free chunks begin
+	bool mounted = false; // set by init or load_from_disk, the superblock is written back on destruction
 
 	SuperBlock(Disk *disk);
+	~SuperBlock();
 
-    void init(double inode_table_size_rel_to_disk);
+    void init(double inode_table_size_rel_to_disk, AllocatorType allocator = AllocatorType::BITMAP);
     void load_from_disk(Disk * disk);
+	void sync(); // writes the superblock (and the current usage counters) to disk
+
+	// answers from the usage counters kept by the bitmaps, without scanning them
+	FileSystemStats statfs() const;
+
+	// reserves space for chunks that will be allocated later, throws if fewer 
+	// than chunk_count chunks are free and unreserved
+	void reserve_chunks(uint64_t chunk_count);
+	void release_chunks(uint64_t chunk_count);
+
+	// allocations never take chunks that are reserved, except out of the caller's
+	// own reservation when one is given. *reservation is drawn down by what it covers
+
+	// allocates one chunk, preferring the allocation group that holds goal (when
+	// non zero) and otherwise the calling thread's group
+	std::shared_ptr<Chunk> allocate_chunk(uint64_t goal = 0, uint64_t *reservation = nullptr);
+	void free_chunk(uint64_t chunk_idx);
+
+	size_t group_index_for_chunk(uint64_t chunk_idx) const;
+	size_t group_index_for_thread() const;
+
+	// allocates a contiguous run of at least min_chunks and at most preferred_chunks, 
+	// choosing the free extent that fits preferred_chunks best (or the one nearest 
+	// to goal when goal is non zero) in the first group that has one, starting 
+	// with the goal's or the calling thread's group. falls back to the largest 
+	// free extent if no extent can hold preferred_chunks. runs are never longer 
+	// than a group. with the buddy allocator the run is rounded to a power of two
+	// and goal is ignored
+	DiskBitMap::BitRange allocate_extent(uint64_t min_chunks, uint64_t preferred_chunks, uint64_t goal = 0, 
+		uint64_t *reservation = nullptr);
+	void free_extent(uint64_t start_chunk, uint64_t chunk_count);
+
+private:
+	void write_superblock(bool clean);
+	// reserves as many chunks as are free and unreserved, up to max_count. throws
+	// if that is fewer than min_count
+	uint64_t reserve_chunks_up_to(uint64_t min_count, uint64_t max_count);
+	// an allocation holds what *reservation does not cover as a reservation of its
+	// own while it looks for chunks. these give the room it may take, and settle 
+	// both once chunk_count chunks were taken
+	uint64_t hold_for_allocation(uint64_t min_count, uint64_t max_count, const uint64_t *reservation, uint64_t &held);
+	void settle_allocation(uint64_t chunk_count, uint64_t *reservation, uint64_t held);
+	std::shared_ptr<Chunk> find_chunk(uint64_t goal);
+	DiskBitMap::BitRange find_extent(uint64_t min_chunks, uint64_t preferred_chunks, uint64_t goal);
+	void build_allocation_groups();
+	std::vector<std::unique_lock<std::mutex>> lock_groups(uint64_t start_chunk, uint64_t chunk_count);
+	// claims range out of group, whose lock is held. false if a lock free 
+	// allocation took a chunk of it first
+	bool claim_group_range(AllocationGroup &group, const DiskBitMap::BitRange &range);
+	void adjust_group_free_chunks(uint64_t start_chunk, uint64_t chunk_count, bool freed);
+};
+
+/*
+	A buddy system allocator for power of two sized runs of chunks in the data
+	area. free blocks are kept in memory as one ordered set per order and are
+	persisted as one bitmap per order (a set bit marks the head of a free block)
+	in metadata chunks that follow the inode table. the disk block map is kept
+	up to date so that the rest of the file system sees the same used chunks
+*/
+struct BuddyAllocator {
+	SuperBlock *superblock;
+	uint64_t metadata_offset; // chunk in which the per order free maps start
+	uint64_t base_chunk; // first chunk managed by the allocator
+	uint64_t size_chunks; // number of chunks managed by the allocator
+	uint64_t max_order;
+
+	std::vector<std::unique_ptr<DiskBitMap>> free_maps;
+	std::vector<std::set<uint64_t>> free_lists; // block offsets relative to base_chunk
 
-	std::shared_ptr<Chunk> allocate_chunk() {
-		DiskBitMap::BitRange range = this->disk_block_map->find_unset_bits(1);
-		if (range.bit_count != 1) {
-			throw FileSystemException("FileSystem out of space -- unable to allocate a new chunk");
-		}
+	BuddyAllocator(SuperBlock *superblock, uint64_t metadata_offset, uint64_t base_chunk, uint64_t size_chunks);
 
-		std::shared_ptr<Chunk> chunk = this->disk->get_chunk(range.start_idx);
-		this->disk_block_map->set(range.start_idx);
+	// the number of metadata chunks needed to manage size_chunks chunks
+	static uint64_t metadata_chunks_for(uint64_t chunk_size, uint64_t size_chunks);
+	// the smallest order whose blocks can hold chunk_count chunks
+	static uint64_t order_for(uint64_t chunk_count);
 
-		return std::move(chunk);
+	uint64_t metadata_size_chunks() const {
+		return metadata_chunks_for(superblock->disk_chunk_size, size_chunks);
 	}
+
+	void format(); // every managed chunk starts out free
+	void load(); // rebuilds the free lists from the free maps on disk
+
+	DiskBitMap::BitRange allocate(uint64_t order);
+	void free(uint64_t start_chunk, uint64_t order);
+
+private:
+	void push_block(uint64_t offset, uint64_t order);
+	void pop_block(uint64_t offset, uint64_t order);
 };
 
 struct FileSystem {
@@ -69,32 +205,140 @@ struct INode;
 
 struct INodeTable {
 	SuperBlock *superblock;
-	uint64_t inode_table_size_chunks = 0; // size of the inode table including used_inodes bitmap + ilist 
+	uint64_t inode_table_size_chunks = 0; // size of the inode table including used_inodes bitmap + ilist + map
 	uint64_t inode_table_offset = 0; // this actually winds up being the offset of the used_inodes bitmap
 	uint64_t inode_ilist_offset = 0; // this ends up storing the calculated real offset of the inodes
 	uint64_t inode_count = 0;
 	uint64_t inodes_per_chunk = 0;
 
+	// inodes handed out by get_inode are shared through inodecache, so every 
+	// user of an inode sees the same object. the most recently used ones are 
+	// also kept alive in recent_inodes, once each, so that hot inodes stay 
+	// loaded. dirty inodes are written back when their last reference goes or
+	// on sync_inodes
+	static constexpr size_t RECENT_INODES = 256;
 	SharedObjectCache<uint64_t, INode> inodecache;
+	std::vector<std::shared_ptr<INode>> recent_inodes;
+	size_t recent_inodes_next = 0;
+	std::mutex inodecache_lock;
+
+	// inodes whose write back failed when their last reference went (the disk 
+	// was full, say) are kept here still dirty. get_inode hands them out again
+	// and sync_inodes retries them. always taken after inodecache_lock
+	std::map<uint64_t, std::unique_ptr<INode>> writeback_failed;
+	std::mutex writeback_lock;
 	std::unique_ptr<DiskBitMap> used_inodes;
 	// struct INode ilist[10]; //TODO: change the size
 
+	// the table is initialized lazily in groups of inodes, one chunk of the 
+	// used_inodes bitmap each. groups from initialized_groups on have never been 
+	// used and may hold anything, a group's bitmap and records are zeroed when 
+	// the first inode in it is needed. a record is zeroed again before its inode
+	// is freed, so an inode allocate_inode has claimed but not yet written reads
+	// as empty. persisted in the superblock
+	uint64_t inodes_per_group = 0;
+	uint64_t group_count = 0;
+	std::atomic<uint64_t> initialized_groups;
+	std::mutex init_lock;
+
+	// once every inode is used the table grows by extensions of EXTENSION_CHUNKS
+	// chunks allocated from the data area, each a bitmap chunk followed by an 
+	// ilist of its own. the first chunk of every extension is listed in the inode
+	// table map, the chunk after the ilist, as [count, offsets...]. extension 
+	// inodes are numbered on from inode_count in the order the extensions were added
+	static constexpr uint64_t EXTENSION_CHUNKS = 64;
+	uint64_t inode_map_offset = 0;
+	uint64_t inodes_per_extension = 0;
+	uint64_t max_extensions = 0;
+	std::vector<uint64_t> extension_offsets; // reserved up front, never reallocated
+	std::vector<std::unique_ptr<DiskBitMap>> extension_inodes;
+	std::atomic<uint64_t> extension_count;
+	std::mutex grow_lock;
+
+	// inodes freed with defer set are detached from the table right away and
+	// their chunks are freed by a background thread, started on first use
+	std::thread reclaimer;
+	std::mutex reclaim_lock;
+	std::condition_variable reclaim_cv;
+	std::deque<std::shared_ptr<INode>> reclaim_queue;
+	uint64_t reclaims_running = 0;
+	bool reclaimer_stop = false;
+
 	// size and offset are in chunks
 	INodeTable(SuperBlock *superblock, uint64_t offset_chunks, uint64_t size_chunks);
+	~INodeTable();
 
+	// formats the table in constant time, every group starts out uninitialized
 	void format_inode_table();
 
-	// returns the size of the entire table in chunks
+	// initializes every group up to and including the one holding idx, if idx
+	// is in the table itself
+	void initialize_groups_through(uint64_t idx);
+	uint64_t initialized_inodes() const {
+		return std::min(inode_count, initialized_groups.load(std::memory_order_acquire) * inodes_per_group);
+	}
+
+	// reads the inode table map and attaches the extensions listed in it
+	void load_extensions();
+
+	// returns the size of the table in chunks, not counting extensions
 	uint64_t size_chunks();
-	uint64_t size_inodes() {
-		return inode_count;
+	uint64_t size_inodes() const {
+		return inode_count + extension_count.load(std::memory_order_acquire) * inodes_per_extension;
 	}
+	uint64_t used_inode_count() const;
 	
-	INode get_inode(uint64_t idx);
+	// allocates a free inode and writes an empty record for it. the slot is 
+	// looked for in the inode table chunk of parent_idx first (when given), then
+	// anywhere from a rotating cursor. throws if there are no free inodes
+	static constexpr uint64_t NO_PARENT = ~0ull;
+	std::atomic<uint64_t> inode_alloc_hint; // byte in used_inodes to resume from
+	uint64_t allocate_inode(uint64_t parent_idx = NO_PARENT);
+
+	std::shared_ptr<INode> get_inode(uint64_t idx);
 	
+	// stores node as inode idx and marks it used. an inode loaded for idx takes
+	// over node's contents
 	void set_inode(uint64_t idx, INode &node);
 
-	void free_inode(uint64_t idx);
+	// set_inode for many inodes at once, (idx, node) pairs. the records are 
+	// grouped by inode table chunk so each chunk is updated once
+	void set_inodes(std::vector<std::pair<uint64_t, INode *>> &records);
+
+	// writes an inode back to its record in the table
+	void write_inode(INode &node);
+
+	// writes back every loaded inode that is dirty, combining the writes to 
+	// each inode table chunk. inodes kept in recent_inodes collect their 
+	// changes until then. writing an inode back flushes its buffered chunks
+	void sync_inodes();
+
+private:
+	void write_records(std::vector<std::pair<uint64_t, INode *>> &records);
+	// the deleter of the inodes handed out by get_inode, writes them back
+	void release_inode(INode *node);
+
+	// the bitmap holding idx's used bit and the bit's index in it
+	DiskBitMap &bitmap_for(uint64_t idx, uint64_t &bit);
+	bool in_use(uint64_t idx);
+	// the chunk holding idx's record and the record's index within it
+	uint64_t record_chunk(uint64_t idx, uint64_t &chunk_offset) const;
+	// adds an extension unless the table already has more than seen_count. 
+	// throws if the map is full, or (as out of space) if there is no free run 
+	// of EXTENSION_CHUNKS chunks
+	void grow(uint64_t seen_count);
+
+public:
+
+	// frees the inode and every chunk of its file. with defer set only the inode
+	// is freed before returning, the chunks follow in the background
+	void free_inode(uint64_t idx, bool defer = false);
+
+	// waits until the background reclaimer has freed everything queued so far
+	void drain_reclaimer();
+
+private:
+	void reclaim_loop();
 };
 
 struct INode {
@@ -105,6 +349,45 @@ struct INode {
 	static constexpr uint64_t ADDRESS_COUNT = DIRECT_ADDRESS_COUNT + INDIRECT_ADDRESS_COUNT + DOUBLE_INDIRECT_ADDRESS_COUNT + TRIPPLE_INDIRECT_ADDRESS_COUNT;
 	static const uint64_t INDIRECT_TABLE_SIZES[4];
 
+	// set on the address of a preallocated chunk that has never been written, 
+	// reads of it return zeros without touching the chunk
+	static constexpr uint64_t UNWRITTEN_FLAG = 1ull << 63;
+	static inline uint64_t address_chunk(uint64_t address) {
+		return address & ~UNWRITTEN_FLAG;
+	}
+
+	// bits of INodeData::inode_bits past the permission bits
+	static constexpr size_t EXTENT_MAPPED_BIT = 11; // addresses holds extents instead of chunk pointers
+	static constexpr size_t INLINE_DATA_BIT = 12; // addresses holds the file's contents
+
+	// when extent mapped the address area holds up to INLINE_EXTENT_COUNT extents
+	// as (logical, physical | UNWRITTEN_FLAG, count) triples, followed by the 
+	// extent count and the root chunk of the extent tree they spill into (0 while
+	// they fit inline). the tree's leaves hold sorted extent triples, the nodes 
+	// above them (first logical chunk, child chunk) pairs
+	static constexpr uint64_t INLINE_EXTENT_COUNT = 3;
+	static constexpr uint64_t EXTENT_COUNT = 9;
+	static constexpr uint64_t EXTENT_TREE_ROOT = 10;
+
+	// a run of logical chunks that are consecutive on disk as well, see map_range
+	struct ChunkExtent {
+		uint64_t logical = 0; // first logical chunk of the run
+		uint64_t physical = 0; // first physical chunk, 0 for a hole
+		uint64_t count = 0;
+		bool unwritten = false; // preallocated and never written
+	};
+
+	// a piece of a file handed out by read_spans without copying it. chunk pins
+	// the chunk the bytes live in, it is null for holes, which point at shared 
+	// zeros, and for inline data, which points into the inode itself
+	struct ReadSpan {
+		std::shared_ptr<Chunk> chunk;
+		const Byte *data = nullptr; // first byte of the span
+		uint64_t offset = 0; // of data within the chunk, or within data.addresses for inline data
+		uint64_t length = 0;
+	};
+	static constexpr uint64_t ZERO_SPAN_SIZE = 64 * 1024;
+
 	struct INodeData {
 		// we store the data in a subclass so that it can be serialized independently 
 		// from data structures that INode needs to keep when loaded in memory
@@ -113,18 +396,193 @@ struct INode {
 		uint64_t file_size = 0; //size of file
 		uint64_t reference_count = 0; //reference count to the inode
 		uint64_t addresses[ADDRESS_COUNT] = {0}; //8 direct
-		std::bitset<11> inode_bits; //rwxrwxrwx (ow, g, oth) dir special 
+		std::bitset<13> inode_bits; //rwxrwxrwx (ow, g, oth) dir special extent_mapped inline_data
+
+		// the on-disk record has a fixed layout of RECORD_SIZE bytes that does not 
+		// depend on how the compiler lays out this struct. the fields stat reads 
+		// come first so they share the record's first cache line, the addresses 
+		// (or inline data) follow. integers are in host byte order, like the superblock
+		static constexpr size_t RECORD_SIZE = 128;
+		static constexpr size_t RECORD_FILE_SIZE = 0;
+		static constexpr size_t RECORD_LAST_MODIFIED = 8;
+		static constexpr size_t RECORD_UID = 16;
+		static constexpr size_t RECORD_REFERENCE_COUNT = 24;
+		static constexpr size_t RECORD_INODE_BITS = 32; // 32 bits, then 32 reserved
+		static constexpr size_t RECORD_ADDRESSES = 40;
+
+		void encode(Byte *record) const;
+		void decode(const Byte *record);
 	};
 
+	// files no larger than the address area keep their contents in it
+	static constexpr uint64_t INLINE_DATA_SIZE = sizeof(INodeData::addresses);
+
 	INodeData data;
-	SuperBlock *superblock;	
+	SuperBlock *superblock = nullptr;
+
+	// set for inodes handed out by INodeTable::get_inode, which are written back
+	// when dirty once the last reference is released (by the table, not ~INode)
+	INodeTable *table = nullptr;
+	uint64_t idx = 0;
+	bool dirty = false;
+	// the inode's last slot in INodeTable::recent_inodes, it is only still there
+	// if the slot holds it. guarded by the table's inodecache_lock
+	static constexpr size_t NOT_RECENT = ~(size_t)0;
+	size_t recent_slot = NOT_RECENT;
+
+	// direct I/O: read moves whole chunks straight from the disk into the 
+	// caller's buffer instead of loading them through the chunk cache. write 
+	// always does this for whole chunks. not stored on disk
+	bool direct_io = false;
+
+	// delayed allocation: chunks written through buffered_write that have no 
+	// physical chunk yet are held here, each with a chunk reserved for it, until 
+	// flush picks physical chunks for all of them at once. the reservation also 
+	// covers the indirect chunks (or extent tree chunks) that mapping them may 
+	// need, delalloc_reserved is what this inode holds in all. flush allocates 
+	// out of it, so it can not run out of space
+	std::map<uint64_t, std::unique_ptr<Byte[]>> delalloc_chunks;
+	uint64_t delalloc_reserved = 0;
+	bool flushing = false;
+
+	// mapping cache: the last level indirect chunks ("leaves") used recently, by 
+	// the run of logical chunks they map. a hit turns address_slot into a hash 
+	// lookup and an index instead of a walk from data.addresses. the leaves are 
+	// shared chunks, so changes to slots through them are never stale
+	static constexpr size_t MAPPING_CACHE_LEAVES = 64;
+	struct MappingCacheEntry {
+		std::shared_ptr<Chunk> leaf;
+		uint64_t last_used = 0;
+	};
+	std::unordered_map<uint64_t, MappingCacheEntry> mapping_cache;
+	uint64_t mapping_cache_clock = 0;
+
+	// extent mapped files keep their extents here by first logical chunk, loaded
+	// on first use and written back by store_extents
+	std::map<uint64_t, ChunkExtent> extent_map;
+	std::vector<uint64_t> extent_tree_chunks; // every node of the extent tree
+	bool extents_loaded = false;
+	bool extents_dirty = false;
+
+	INode() = default;
+	INode(INode &&) = default;
+	INode &operator=(INode &&) = default;
+	~INode();
+
+	// finds the slot holding the address of logical chunk chunk_number, either in
+	// data.addresses or in an indirect chunk which is kept alive through holder.
+	// missing indirect chunks are allocated if create is set, otherwise nullptr is 
+	// returned when the walk runs into a hole
+	uint64_t *address_slot(uint64_t chunk_number, bool create, std::shared_ptr<Chunk> &holder);
+
+	void cache_leaf(uint64_t leaf_number, const std::shared_ptr<Chunk> &leaf);
+
+	void mark_dirty() {
+		dirty = true;
+	}
+
+	// must be called whenever indirect chunks are freed or replaced
+	void drop_mapping_cache() {
+		mapping_cache.clear();
+	}
 
 	std::shared_ptr<Chunk> resolve_indirection(uint64_t chunk_number);
 
-	// NOTE: read is NOT const, it will allocate chunks when reading inodes 
-	// that have not been written but that ARE within the size of the file,
-	// TODO: possibly be smart about this
+	// the address (physical chunk, possibly with UNWRITTEN_FLAG) of a logical 
+	// chunk in either format, 0 for a hole. nothing is allocated
+	uint64_t lookup_address(uint64_t chunk_number);
+
+	// maps count logical chunks starting at chunk_number to consecutive addresses
+	// starting at address, allocating indirect chunks as needed
+	void set_addresses(uint64_t chunk_number, uint64_t address, uint64_t count);
+
+	// where new chunks for this file should preferably go
+	uint64_t allocation_goal();
+
+	// switches an empty file to extent mapping, throws if it has chunks already
+	void use_extent_mapping();
+	bool extent_mapped() const {
+		return data.inode_bits[EXTENT_MAPPED_BIT];
+	}
+
+	void load_extents();
+
+	bool has_inline_data() const {
+		return data.inode_bits[INLINE_DATA_BIT];
+	}
+
+	// handles writes that leave the file small enough to stay inline, returns 
+	// false if the chunk path has to be used. a file only starts out inline 
+	// when it has no chunks at all
+	bool write_inline(uint64_t starting_offset, const char *buf, uint64_t n);
+
+	// moves inline contents out to a chunk, everything that looks at the 
+	// file's mapping does this first
+	void migrate_inline_data();
+
+	// writes the extents back to the address area or the extent tree, called by
+	// INodeTable::set_inode and flush
+	void store_extents();
+	// the chunks an extent tree over extent_count extents takes
+	uint64_t extent_tree_chunks_for(uint64_t extent_count) const;
+
+	// resolves logical chunks [first_chunk, first_chunk + count) with one walk of
+	// the indirect tree per leaf, coalesced into extents that cover the range in
+	// order. holes (including chunks only buffered for delayed allocation) come 
+	// back as extents with physical 0. nothing is allocated
+	void map_range(uint64_t first_chunk, uint64_t count, std::vector<ChunkExtent> &extents);
+
+	// holes at any level of the file's mapping read as zeros, reading never 
+	// allocates or fetches chunks for them
 	uint64_t read(uint64_t starting_offset, char *buf, uint64_t n);
+
+	// like read but instead of copying, appends spans covering the range to spans
+	// and returns how many bytes they cover. delayed allocation buffers in the 
+	// range are flushed first, so that every span is backed by a real chunk
+	uint64_t read_spans(uint64_t starting_offset, uint64_t n, std::vector<ReadSpan> &spans);
+
+	// writes into the chunks already backing the file, or into delayed allocation
+	// buffers for the parts of the file that have no chunks yet
+	uint64_t buffered_write(uint64_t starting_offset, const char *buf, uint64_t n);
+
+	// allocates the buffered chunks as one contiguous extent (as far as free space
+	// allows) and writes them out. the inode must be saved with 
+	// INodeTable::set_inode afterwards
+	void flush();
+	void flush_buffered();
+
+	// the number of indirect chunks on the path to chunk_number's slot, the most
+	// mapping it can allocate. the buffered chunks sharing a leaf reserve them once
+	uint64_t indirect_chunks_for(uint64_t chunk_number) const;
+	uint64_t leaf_first_chunk(uint64_t chunk_number) const;
+	// what the buffered chunks need reserved in all. when extent mapped every one
+	// of them may add an extent, and the tree may need chunks for those
+	uint64_t delalloc_reservation() const;
+	// hands back whatever is reserved beyond delalloc_reservation
+	void trim_delalloc_reservation();
+
+	// writes straight to disk: runs of whole chunks are copied in bulk without 
+	// reading them first, only the partial chunks at either end are read and 
+	// modified. chunks missing in the range are allocated together up front
+	uint64_t write(uint64_t starting_offset, const char *buf, uint64_t n);
+
+	// sets the file size, freeing every chunk (and indirect chunk) that is past
+	// the new end in one walk of the mapping. the freed chunks are returned to 
+	// the allocator as sorted runs. growing only moves the size, leaving a hole
+	void truncate(uint64_t new_size);
+
+	// frees whatever slot maps at or past logical chunk keep_chunks. slot maps 
+	// the chunks from first_logical on through depth levels of indirect chunks
+	void truncate_slot(uint64_t &slot, uint64_t depth, uint64_t first_logical, uint64_t keep_chunks, std::vector<uint64_t> &freed);
+
+	// allocates chunks for every hole in [starting_offset, starting_offset + n) in
+	// as few contiguous extents as possible and marks them unwritten. the file 
+	// grows to cover the range unless keep_size is set
+	void preallocate(uint64_t starting_offset, uint64_t n, bool keep_size = false);
+
+	// gives every hole among logical chunks [first_chunk, last_chunk] a physical
+	// chunk, marked unwritten, allocating contiguous extents where possible
+	void allocate_holes(uint64_t first_chunk, uint64_t last_chunk);
 };
 
 #endif
\ No newline at end of file
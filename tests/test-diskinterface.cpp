@@ -1,4 +1,5 @@
 #include <iostream>
+#include <thread>
 
 #include "catch.hpp"
 
@@ -14,6 +15,7 @@ TEST_CASE( "Disk interface should work", "[diskinterface]" ) {
 		REQUIRE(chunk0->size_bytes == disk->chunk_size());
 		REQUIRE(chunk0->chunk_idx == 0);
 		REQUIRE(chunk0->data != nullptr);
+		REQUIRE((uintptr_t)chunk0->data.get() % Chunk::ALIGNMENT == 0);
 	}
 
 	SECTION("that chunk should be filled with 0's by default") {
@@ -180,4 +182,263 @@ TEST_CASE( "Disk bitmap should work", "[bitmap]" ) {
 			REQUIRE(range2.start_idx == 53);
 		}
 	}
-}
\ No newline at end of file
+
+	SECTION("searches resume where the last allocation ended and wrap around to the front") {
+		std::unique_ptr<Disk> disk(new Disk(256, 16));
+		std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 0, 64));
+		bitmap->clear_all();
+
+		auto range = bitmap->find_unset_bits(20);
+		REQUIRE(range.start_idx == 0);
+		REQUIRE(range.bit_count == 20);
+		range.set_range(*bitmap);
+
+		// freeing bits at the front does not pull the cursor back
+		bitmap->clr(3);
+		auto range2 = bitmap->find_unset_bits(4);
+		REQUIRE(range2.start_idx == 20);
+		REQUIRE(range2.bit_count == 4);
+		range2.set_range(*bitmap);
+
+		auto range3 = bitmap->find_unset_bits(64);
+		REQUIRE(range3.start_idx == 24);
+		REQUIRE(range3.bit_count == 40);
+		range3.set_range(*bitmap);
+
+		// the end of the map is full, so the search wraps around
+		auto range4 = bitmap->find_unset_bits(1);
+		REQUIRE(range4.start_idx == 3);
+		REQUIRE(range4.bit_count == 1);
+	}
+
+	SECTION("a caller owned cursor is independent from the bitmap's cursor") {
+		std::unique_ptr<Disk> disk(new Disk(256, 16));
+		std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 0, 64));
+		bitmap->clear_all();
+
+		uint64_t hint = 4;
+		auto range = bitmap->find_unset_bits(8, hint);
+		REQUIRE(range.start_idx == 32);
+		REQUIRE(range.bit_count == 8);
+		REQUIRE(hint == 5);
+
+		auto range2 = bitmap->find_unset_bits(8);
+		REQUIRE(range2.start_idx == 0);
+	}
+}
+
+TEST_CASE( "Atomic bitmap operations should work", "[bitmap][atomic]" ) {
+	// chunk sizes of 16 bytes allow 64 bit words, 4 byte chunks fall back to bytes
+	const Size chunk_size = GENERATE(16, 4);
+	std::unique_ptr<Disk> disk(new Disk(256, chunk_size));
+	std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 0, 200));
+	bitmap->clear_all();
+
+	SECTION("set and clr return the previous value of the bit") {
+		REQUIRE_FALSE(bitmap->atomic_set(70));
+		REQUIRE(bitmap->atomic_set(70));
+		REQUIRE(bitmap->get(70));
+		REQUIRE(bitmap->atomic_get(70));
+		REQUIRE_FALSE(bitmap->get(71));
+		REQUIRE(bitmap->atomic_clr(70));
+		REQUIRE_FALSE(bitmap->atomic_clr(70));
+		REQUIRE_FALSE(bitmap->get(70));
+	}
+
+	SECTION("claiming bits respects the range and the cursor") {
+		uint64_t hint = 0;
+		Size claimed = 0;
+		REQUIRE(bitmap->claim_unset_bit(claimed, hint, 67, 72));
+		REQUIRE(claimed == 67);
+		REQUIRE(bitmap->get(67));
+
+		bitmap->set(68);
+		REQUIRE(bitmap->claim_unset_bit(claimed, hint, 67, 72));
+		REQUIRE(claimed == 69);
+
+		REQUIRE(bitmap->claim_unset_bit(claimed, hint, 67, 72));
+		REQUIRE(bitmap->claim_unset_bit(claimed, hint, 67, 72));
+		REQUIRE(claimed == 71);
+		REQUIRE_FALSE(bitmap->claim_unset_bit(claimed, hint, 67, 72));
+		REQUIRE_FALSE(bitmap->get(72));
+
+		// the cursor wraps back around to the start of the range
+		bitmap->clr(68);
+		REQUIRE(bitmap->claim_unset_bit(claimed, hint, 67, 72));
+		REQUIRE(claimed == 68);
+	}
+
+	SECTION("threads claiming bits at the same time never claim the same bit") {
+		constexpr int THREADS = 4;
+		std::vector<std::vector<Size>> claimed(THREADS);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < THREADS; ++t) {
+			threads.push_back(std::thread([&, t]() {
+				uint64_t hint = 0;
+				Size idx = 0;
+				while (bitmap->claim_unset_bit(idx, hint, 0, 200)) {
+					claimed[t].push_back(idx);
+				}
+			}));
+		}
+		for (auto &thread : threads) 
+			thread.join();
+
+		std::vector<bool> seen(200, false);
+		size_t total = 0;
+		for (auto &bits : claimed) {
+			for (Size idx : bits) {
+				REQUIRE_FALSE(seen[idx]);
+				seen[idx] = true;
+				total++;
+			}
+		}
+		REQUIRE(total == 200);
+	}
+
+	SECTION("set and clr do not lose bits claimed in the same word") {
+		// 64 to 100 are claimed while 100 to 128, in the same word, are flipped
+		std::thread flipper([&]() {
+			for (int round = 0; round < 1000; ++round) {
+				for (Size idx = 100; idx < 128; ++idx) 
+					bitmap->set(idx);
+				for (Size idx = 100; idx < 128; ++idx) 
+					bitmap->clr(idx);
+			}
+		});
+		uint64_t hint = 0;
+		Size idx = 0;
+		Size claims = 0;
+		while (bitmap->claim_unset_bit(idx, hint, 64, 100)) 
+			claims++;
+		flipper.join();
+
+		REQUIRE(claims == 36);
+		for (Size bit = 64; bit < 100; ++bit) 
+			REQUIRE(bitmap->get(bit));
+		REQUIRE(bitmap->count_set_bits() == 36);
+	}
+}
+
+TEST_CASE( "Disk bitmaps can be shared between owners and threads", "[bitmap][locking]" ) {
+	std::unique_ptr<Disk> disk(new Disk(256, 16));
+	std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 0, 512));
+	bitmap->clear_all();
+
+	SECTION("a second map over the same chunks sees the first map's updates") {
+		DiskBitMap reader(disk.get(), 0, 512);
+		bitmap->set(100);
+		REQUIRE(reader.get(100));
+		reader.clr(100);
+		REQUIRE_FALSE(bitmap->get(100));
+	}
+
+	SECTION("chunk locks are only held for the duration of a range operation") {
+		DiskBitMap::BitRange range;
+		range.start_idx = 120;
+		range.bit_count = 20;
+		range.set_range(*bitmap);
+
+		// bits 120..139 span the first two chunks, both must be free again
+		auto locks = bitmap->lock_range(120, 20);
+		REQUIRE(locks.size() == 2);
+		for (size_t i = 0; i < 2; ++i) {
+			REQUIRE(locks[i].owns_lock());
+		}
+		locks.clear();
+		REQUIRE(bitmap->chunks[0]->lock.try_lock());
+		bitmap->chunks[0]->lock.unlock();
+	}
+
+	SECTION("threads setting and clearing neighbouring bits do not lose updates") {
+		constexpr int THREADS = 8;
+		std::vector<std::thread> threads;
+		for (int t = 0; t < THREADS; ++t) {
+			threads.push_back(std::thread([&, t]() {
+				// every thread owns every 8th bit, so all threads share every byte
+				for (int round = 0; round < 100; ++round) {
+					for (Size idx = t; idx < 512; idx += THREADS) 
+						bitmap->set(idx);
+					for (Size idx = t; idx < 512; idx += THREADS) 
+						bitmap->clr(idx);
+				}
+				for (Size idx = t; idx < 512; idx += THREADS) 
+					bitmap->set(idx);
+			}));
+		}
+		for (auto &thread : threads) 
+			thread.join();
+
+		REQUIRE(bitmap->set_count == 512);
+		REQUIRE(bitmap->count_set_bits() == 512);
+	}
+}
+
+TEST_CASE( "Free extent tree should work", "[extents]" ) {
+	std::unique_ptr<Disk> disk(new Disk(256, 16));
+	std::unique_ptr<DiskBitMap> bitmap(new DiskBitMap(disk.get(), 0, 128));
+	bitmap->clear_all();
+
+	// used: [0, 10), [14, 40), [48, 100), [101, 128), leaving free extents
+	// [10, 14), [40, 48) and [100, 101)
+	auto set_range = [&](Size start_idx, Size bit_count) {
+		DiskBitMap::BitRange range;
+		range.start_idx = start_idx;
+		range.bit_count = bit_count;
+		range.set_range(*bitmap);
+	};
+	set_range(0, 10);
+	set_range(14, 26);
+	set_range(48, 52);
+	set_range(101, 27);
+
+	FreeExtentTree tree;
+	tree.build(*bitmap, 0, 128);
+
+	SECTION("building from a bitmap finds every free extent") {
+		REQUIRE(tree.extent_count() == 3);
+		REQUIRE(tree.free_count() == 13);
+		REQUIRE(tree.containing(11).start_idx == 10);
+		REQUIRE(tree.containing(11).bit_count == 4);
+		REQUIRE(tree.containing(47).start_idx == 40);
+		REQUIRE(tree.containing(20).bit_count == 0);
+		REQUIRE(tree.largest().start_idx == 40);
+		REQUIRE(tree.largest().bit_count == 8);
+	}
+
+	SECTION("first fit, best fit and near fit pick the right extents") {
+		REQUIRE(tree.first_fit(1).start_idx == 10);
+		REQUIRE(tree.first_fit(5).start_idx == 40);
+		REQUIRE(tree.first_fit(9).bit_count == 0);
+
+		REQUIRE(tree.best_fit(1).start_idx == 100);
+		REQUIRE(tree.best_fit(3).start_idx == 10);
+		REQUIRE(tree.best_fit(3).bit_count == 3);
+
+		REQUIRE(tree.near_fit(2, 42).start_idx == 42);
+		REQUIRE(tree.near_fit(2, 98).start_idx == 46);
+		REQUIRE(tree.near_fit(1, 98).start_idx == 100);
+		REQUIRE(tree.near_fit(4, 0).start_idx == 10);
+		REQUIRE(tree.near_fit(4, 127).start_idx == 44);
+	}
+
+	SECTION("removing and inserting splits and coalesces extents") {
+		tree.remove(42, 2);
+		REQUIRE(tree.extent_count() == 4);
+		REQUIRE(tree.free_count() == 11);
+		REQUIRE(tree.containing(41).bit_count == 2);
+		REQUIRE(tree.containing(44).start_idx == 44);
+
+		tree.insert(42, 2);
+		REQUIRE(tree.extent_count() == 3);
+		REQUIRE(tree.containing(41).bit_count == 8);
+
+		tree.insert(14, 26);
+		REQUIRE(tree.extent_count() == 2);
+		REQUIRE(tree.largest().start_idx == 10);
+		REQUIRE(tree.largest().bit_count == 38);
+
+		REQUIRE_THROWS(tree.insert(12, 1));
+		REQUIRE_THROWS(tree.remove(0, 1));
+	}
+}
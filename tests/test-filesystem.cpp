@@ -1,4 +1,8 @@
 #include <iostream>
+#include <thread>
+#include <set>
+#include <algorithm>
+#include <chrono>
 
 #include "catch.hpp"
 
@@ -12,4 +16,1370 @@ TEST_CASE( "Making a filesystem should work", "[filesystem]" ) {
     std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
     std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
     fs->superblock->init(0.1);
-}
\ No newline at end of file
+}
+
+TEST_CASE( "Free extent index is built at mount and kept in sync", "[filesystem][extents]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    uint64_t data_offset = 0;
+    uint64_t first_chunk = 0;
+
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->init(0.1);
+        data_offset = fs->superblock->data_offset;
+        REQUIRE(fs->superblock->allocation_groups[0]->free_extents.free_count() == CHUNK_COUNT - data_offset);
+        REQUIRE(fs->superblock->allocation_groups[0]->free_extents.extent_count() == 1);
+
+        for (int i = 0; i < 3; ++i) {
+            auto chunk = fs->superblock->allocate_chunk();
+            if (i == 0) 
+                first_chunk = chunk->chunk_idx;
+        }
+        REQUIRE(first_chunk == data_offset);
+        fs->superblock->free_chunk(first_chunk + 1);
+        REQUIRE(fs->superblock->allocation_groups[0]->free_extents.extent_count() == 2);
+        REQUIRE(fs->superblock->allocation_groups[0]->free_extents.free_count() == CHUNK_COUNT - data_offset - 2);
+    }
+
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->load_from_disk(disk.get());
+        REQUIRE(fs->superblock->data_offset == data_offset);
+        REQUIRE(fs->superblock->allocation_groups[0]->free_extents.free_count() == CHUNK_COUNT - data_offset - 2);
+        REQUIRE(fs->superblock->allocation_groups[0]->free_extents.containing(first_chunk + 1).bit_count == 1);
+        REQUIRE(fs->superblock->allocation_groups[0]->free_extents.containing(first_chunk).bit_count == 0);
+    }
+}
+
+TEST_CASE( "Contiguous extents can be allocated from the superblock", "[filesystem][extents]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+    SuperBlock *sb = fs->superblock.get();
+    const uint64_t data_offset = sb->data_offset;
+
+    // carve the data area into holes of 3, 100 and 40 chunks followed by the rest
+    auto a = sb->allocate_extent(10, 10);
+    REQUIRE(a.start_idx == data_offset);
+    REQUIRE(a.bit_count == 10);
+    auto hole3 = sb->allocate_extent(3, 3);
+    sb->allocate_extent(10, 10);
+    auto hole100 = sb->allocate_extent(100, 100);
+    sb->allocate_extent(10, 10);
+    auto hole40 = sb->allocate_extent(40, 40);
+    auto d = sb->allocate_extent(10, 10);
+    sb->free_extent(hole3.start_idx, hole3.bit_count);
+    sb->free_extent(hole100.start_idx, hole100.bit_count);
+    sb->free_extent(hole40.start_idx, hole40.bit_count);
+
+    SECTION("the best fitting run is returned rather than the first one") {
+        auto range = sb->allocate_extent(1, 30);
+        REQUIRE(range.start_idx == hole40.start_idx);
+        REQUIRE(range.bit_count == 30);
+        for (uint64_t idx = range.start_idx; idx < range.start_idx + range.bit_count; ++idx) {
+            REQUIRE(sb->disk_block_map->get(idx));
+        }
+
+        auto range2 = sb->allocate_extent(1, 100);
+        REQUIRE(range2.start_idx == hole100.start_idx);
+        REQUIRE(range2.bit_count == 100);
+    }
+
+    SECTION("a goal picks the run nearest to it") {
+        auto range = sb->allocate_extent(1, 2, hole100.start_idx + 50);
+        REQUIRE(range.start_idx == hole100.start_idx + 50);
+        REQUIRE(range.bit_count == 2);
+    }
+
+    SECTION("when nothing fits the preferred size the largest run is returned") {
+        auto rest = sb->allocate_extent(1, CHUNK_COUNT);
+        REQUIRE(rest.start_idx == d.start_idx + d.bit_count);
+        REQUIRE(rest.bit_count == CHUNK_COUNT - rest.start_idx);
+
+        auto range = sb->allocate_extent(50, 200);
+        REQUIRE(range.start_idx == hole100.start_idx);
+        REQUIRE(range.bit_count == 100);
+
+        REQUIRE_THROWS_AS(sb->allocate_extent(41, 200), FileSystemException);
+    }
+}
+
+TEST_CASE( "Buddy allocator hands out and coalesces power of two extents", "[filesystem][buddy]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    uint64_t base = 0;
+    DiskBitMap::BitRange kept;
+
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->init(0.1, AllocatorType::BUDDY);
+        SuperBlock *sb = fs->superblock.get();
+        BuddyAllocator *buddy = sb->buddy.get();
+        base = sb->data_offset;
+        REQUIRE(buddy->base_chunk == base);
+        REQUIRE(buddy->size_chunks == CHUNK_COUNT - base);
+        REQUIRE(sb->allocation_groups.empty());
+
+        const std::vector<std::set<uint64_t>> initial_free_lists = buddy->free_lists;
+
+        // sizes are rounded down to a power of two unless that violates the minimum
+        auto a = sb->allocate_extent(1, 6);
+        REQUIRE(a.bit_count == 4);
+        REQUIRE((a.start_idx - base) % 4 == 0);
+        auto b = sb->allocate_extent(3, 3);
+        REQUIRE(b.bit_count == 4);
+        REQUIRE((b.start_idx - base) % 4 == 0);
+        auto c = sb->allocate_chunk();
+        REQUIRE(sb->disk_block_map->get(c->chunk_idx));
+        for (uint64_t idx = a.start_idx; idx < a.start_idx + a.bit_count; ++idx) {
+            REQUIRE(sb->disk_block_map->get(idx));
+        }
+
+        // freeing everything merges the split blocks back together
+        sb->free_extent(a.start_idx, a.bit_count);
+        sb->free_extent(b.start_idx, b.bit_count);
+        REQUIRE_FALSE(sb->disk_block_map->get(a.start_idx));
+        REQUIRE(buddy->free_lists != initial_free_lists);
+        sb->free_chunk(c->chunk_idx);
+        REQUIRE(buddy->free_lists == initial_free_lists);
+
+        REQUIRE_THROWS_AS(sb->free_extent(a.start_idx, 4), FileSystemException);
+        REQUIRE_THROWS_AS(sb->free_extent(c->chunk_idx, 1), FileSystemException);
+        REQUIRE_THROWS_AS(sb->free_extent(b.start_idx, 3), FileSystemException);
+
+        kept = sb->allocate_extent(16, 16);
+    }
+
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->load_from_disk(disk.get());
+        SuperBlock *sb = fs->superblock.get();
+        REQUIRE(sb->allocator_type == AllocatorType::BUDDY);
+        REQUIRE(sb->data_offset == base);
+
+        // the free lists come back from disk, so the kept extent can be freed 
+        // and merged with its buddies again
+        sb->free_extent(kept.start_idx, kept.bit_count);
+        REQUIRE_THROWS_AS(sb->free_extent(kept.start_idx, kept.bit_count), FileSystemException);
+        auto again = sb->allocate_extent(16, 16);
+        REQUIRE(again.start_idx == kept.start_idx);
+    }
+}
+
+TEST_CASE( "Allocation groups let threads allocate concurrently", "[filesystem][groups]" ) {
+    constexpr uint64_t CHUNK_COUNT = 4096;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->allocation_group_size_chunks = 512;
+    fs->superblock->init(0.1);
+    SuperBlock *sb = fs->superblock.get();
+
+    REQUIRE(sb->allocation_groups.size() == CHUNK_COUNT / 512 - sb->data_offset / 512);
+    uint64_t free_chunks = 0;
+    for (auto &group : sb->allocation_groups) {
+        REQUIRE(group->start_chunk % 8 == 0);
+        free_chunks += group->free_chunks;
+    }
+    REQUIRE(free_chunks == CHUNK_COUNT - sb->data_offset);
+
+    SECTION("a goal keeps allocations in the goal's group") {
+        const uint64_t goal = CHUNK_COUNT - 100;
+        auto chunk = sb->allocate_chunk(goal);
+        REQUIRE(sb->group_index_for_chunk(chunk->chunk_idx) == sb->group_index_for_chunk(goal));
+        REQUIRE(sb->allocation_groups.back()->free_chunks == 511);
+    }
+
+    SECTION("runs stay within one group") {
+        // the free space of the last two groups is contiguous on disk
+        const uint64_t groups = sb->allocation_groups.size();
+        auto range = sb->allocate_extent(1, 1024, sb->allocation_groups[groups - 2]->start_chunk);
+        REQUIRE(range.bit_count == 512);
+        REQUIRE(range.start_idx == sb->allocation_groups[groups - 2]->start_chunk);
+        REQUIRE(sb->allocation_groups[groups - 2]->free_chunks == 0);
+        REQUIRE(sb->allocation_groups[groups - 1]->free_chunks == 512);
+    }
+
+    SECTION("threads allocating at the same time never get the same chunk") {
+        constexpr int THREADS = 4;
+        constexpr int PER_THREAD = 200;
+        std::vector<std::vector<uint64_t>> allocated(THREADS);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; ++t) {
+            threads.push_back(std::thread([&, t]() {
+                for (int i = 0; i < PER_THREAD; ++i) {
+                    allocated[t].push_back(sb->allocate_chunk()->chunk_idx);
+                    if (i % 4 == 0) 
+                        allocated[t].push_back(sb->allocate_extent(2, 2).start_idx);
+                }
+            }));
+        }
+        for (auto &thread : threads) 
+            thread.join();
+
+        std::set<uint64_t> seen;
+        for (auto &chunks : allocated) {
+            for (uint64_t chunk_idx : chunks) {
+                REQUIRE(seen.insert(chunk_idx).second);
+                REQUIRE(sb->disk_block_map->get(chunk_idx));
+            }
+        }
+
+        uint64_t free_after = 0;
+        for (auto &group : sb->allocation_groups) 
+            free_after += group->free_chunks;
+        REQUIRE(free_after == free_chunks - THREADS * (PER_THREAD + PER_THREAD / 4 * 2));
+        uint64_t indexed = 0;
+        for (auto &group : sb->allocation_groups) {
+            REQUIRE(group->free_extents.free_count() == group->free_chunks);
+            indexed += group->free_extents.free_count();
+        }
+        REQUIRE(indexed == free_after);
+    }
+}
+
+TEST_CASE( "statfs answers from counters that survive a remount", "[filesystem][statfs]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    FileSystemStats before;
+
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->init(0.1);
+        SuperBlock *sb = fs->superblock.get();
+
+        FileSystemStats stats = sb->statfs();
+        REQUIRE(stats.chunk_size == CHUNK_SIZE);
+        REQUIRE(stats.total_chunks == CHUNK_COUNT);
+        REQUIRE(stats.free_chunks == CHUNK_COUNT - sb->data_offset);
+        REQUIRE(stats.total_inodes == sb->inode_table->size_inodes());
+        REQUIRE(stats.free_inodes == stats.total_inodes);
+
+        sb->allocate_chunk();
+        auto range = sb->allocate_extent(10, 10);
+        sb->free_extent(range.start_idx + 2, 3);
+        INode node;
+        sb->inode_table->set_inode(5, node);
+        sb->inode_table->set_inode(6, node);
+        sb->inode_table->free_inode(6);
+
+        before = sb->statfs();
+        REQUIRE(before.free_chunks == stats.free_chunks - 8);
+        REQUIRE(before.free_inodes == stats.free_inodes - 1);
+        REQUIRE(before.free_chunks == CHUNK_COUNT - sb->disk_block_map->count_set_bits());
+    }
+
+    SECTION("a clean unmount persists the counters") {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->load_from_disk(disk.get());
+        FileSystemStats after = fs->superblock->statfs();
+        REQUIRE(after.free_chunks == before.free_chunks);
+        REQUIRE(after.free_inodes == before.free_inodes);
+    }
+
+    SECTION("counters are recounted when the file system was not unmounted cleanly") {
+        {
+            // clear the clean flag and scribble over the saved counters
+            auto sb_chunk = disk->get_chunk(0);
+            uint64_t *words = (uint64_t *)sb_chunk->data.get();
+            words[12] = 0;
+            words[13] = 1;
+            words[14] = 1;
+        }
+
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->load_from_disk(disk.get());
+        FileSystemStats after = fs->superblock->statfs();
+        REQUIRE(after.free_chunks == before.free_chunks);
+        REQUIRE(after.free_inodes == before.free_inodes);
+    }
+}
+
+TEST_CASE( "Buffered writes delay allocation until flush", "[filesystem][inode][delalloc]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+    SuperBlock *sb = fs->superblock.get();
+
+    // fragment the free space so that chunk at a time allocation would interleave
+    sb->allocate_chunk();
+    const uint64_t gap = sb->allocate_chunk()->chunk_idx;
+    sb->allocate_chunk();
+    sb->free_chunk(gap);
+
+    INode node;
+    node.superblock = sb;
+    const uint64_t free_before = sb->disk_block_map->unset_count();
+
+    // write 12 chunks worth of data in small, unaligned pieces
+    std::vector<char> data(CHUNK_SIZE * 12);
+    for (size_t i = 0; i < data.size(); ++i) 
+        data[i] = (char)(i * 7 + 3);
+    for (size_t offset = 0; offset < data.size(); offset += 100) {
+        const size_t length = std::min((size_t)100, data.size() - offset);
+        REQUIRE(node.buffered_write(offset, data.data() + offset, length) == length);
+    }
+
+    REQUIRE(node.data.file_size == data.size());
+    REQUIRE(node.delalloc_chunks.size() == 12);
+    REQUIRE(sb->disk_block_map->unset_count() == free_before);
+    // the indirect chunk that maps chunks 8 and up is reserved as well
+    REQUIRE(sb->statfs().free_chunks == free_before - 13);
+
+    std::vector<char> out(data.size());
+    REQUIRE(node.read(0, out.data(), out.size()) == out.size());
+    REQUIRE(out == data);
+
+    node.flush();
+    REQUIRE(node.delalloc_chunks.empty());
+    REQUIRE(sb->reserved_chunks == 0);
+
+    // the 12 chunks land in one run, so the one chunk gap is skipped over
+    std::shared_ptr<Chunk> holder;
+    const uint64_t first = *node.address_slot(0, false, holder);
+    REQUIRE(first != gap);
+    for (uint64_t i = 1; i < 12; ++i) {
+        uint64_t *slot = node.address_slot(i, false, holder);
+        REQUIRE(slot != nullptr);
+        REQUIRE(*slot == first + i);
+    }
+    // 12 data chunks plus the single indirect chunk for chunks 8 and up
+    REQUIRE(sb->disk_block_map->unset_count() == free_before - 13);
+
+    std::fill(out.begin(), out.end(), 0);
+    REQUIRE(node.read(0, out.data(), out.size()) == out.size());
+    REQUIRE(out == data);
+
+    // overwriting flushed data goes straight to the chunk
+    node.buffered_write(10, "hello", 5);
+    REQUIRE(node.delalloc_chunks.empty());
+    char hello[6] = {0};
+    node.read(10, hello, 5);
+    REQUIRE(std::string(hello) == "hello");
+}
+
+TEST_CASE( "Buffered writes reserve the indirect chunks they need", "[filesystem][inode][delalloc]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+    SuperBlock *sb = fs->superblock.get();
+    while (sb->disk_block_map->unset_count() > 12) 
+        sb->allocate_chunk();
+
+    std::vector<char> data(CHUNK_SIZE * 12, 'x');
+    {
+        // 12 data chunks and their indirect chunk do not fit
+        INode node;
+        node.superblock = sb;
+        REQUIRE_THROWS_AS(node.buffered_write(0, data.data(), data.size()), FileSystemException);
+        REQUIRE(sb->reserved_chunks == node.delalloc_reserved);
+
+        // 11 and the indirect chunk do
+        node.truncate(0);
+        REQUIRE(node.buffered_write(0, data.data(), CHUNK_SIZE * 11) == CHUNK_SIZE * 11);
+        REQUIRE(sb->reserved_chunks == 12);
+        node.flush();
+        REQUIRE(sb->reserved_chunks == 0);
+        REQUIRE(sb->disk_block_map->unset_count() == 0);
+    }
+    REQUIRE(sb->reserved_chunks == 0);
+}
+
+TEST_CASE( "Reserved chunks are kept from other allocations", "[filesystem][inode][delalloc]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+    SuperBlock *sb = fs->superblock.get();
+
+    INode node;
+    node.superblock = sb;
+    std::vector<char> data(CHUNK_SIZE, 'r');
+    uint64_t reserved = 0;
+
+    SECTION("indirect mapped") {
+        // 10 data chunks and the indirect chunk for chunks 8 and up
+        for (uint64_t i = 0; i < 10; ++i) 
+            node.buffered_write(i * CHUNK_SIZE, data.data(), data.size());
+        reserved = 11;
+    }
+
+    SECTION("extent mapped") {
+        // 4 separate extents do not fit inline, so a tree chunk is reserved too
+        node.use_extent_mapping();
+        for (uint64_t i = 0; i < 4; ++i) 
+            node.buffered_write(2 * i * CHUNK_SIZE, data.data(), data.size());
+        reserved = 5;
+    }
+
+    REQUIRE(sb->reserved_chunks == reserved);
+
+    // allocations that do not draw on the reservation stop short of it
+    while (true) {
+        try {
+            sb->allocate_chunk();
+        } catch (const FileSystemException &) {
+            break;
+        }
+    }
+    REQUIRE(sb->disk_block_map->unset_count() == reserved);
+    REQUIRE_THROWS_AS(sb->allocate_extent(1, 1), FileSystemException);
+
+    node.flush();
+    REQUIRE(node.delalloc_chunks.empty());
+    REQUIRE(sb->reserved_chunks == 0);
+    REQUIRE(sb->disk_block_map->unset_count() == 0);
+    if (node.extent_mapped()) 
+        REQUIRE(node.extent_tree_chunks.size() == 1);
+
+    std::vector<char> out(CHUNK_SIZE);
+    REQUIRE(node.read(0, out.data(), out.size()) == out.size());
+    REQUIRE(out == data);
+}
+
+TEST_CASE( "Preallocated ranges read as zeros until written", "[filesystem][inode][preallocate]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+    SuperBlock *sb = fs->superblock.get();
+
+    INode node;
+    node.superblock = sb;
+    const uint64_t free_before = sb->disk_block_map->unset_count();
+
+    node.preallocate(0, CHUNK_SIZE * 20);
+    REQUIRE(node.data.file_size == CHUNK_SIZE * 20);
+    // 20 data chunks plus the indirect chunk for chunks 8 and up
+    REQUIRE(sb->disk_block_map->unset_count() == free_before - 21);
+
+    std::shared_ptr<Chunk> holder;
+    const uint64_t first = *node.address_slot(0, false, holder);
+    REQUIRE((first & INode::UNWRITTEN_FLAG) != 0);
+    for (uint64_t i = 1; i < 20; ++i) {
+        REQUIRE(*node.address_slot(i, false, holder) == first + i);
+    }
+
+    // stale data on the preallocated chunks must not leak out through reads
+    {
+        auto chunk = disk->get_chunk(INode::address_chunk(first) + 3);
+        std::memset(chunk->data.get(), 0x5A, CHUNK_SIZE);
+    }
+    std::vector<char> out(CHUNK_SIZE * 20, 1);
+    REQUIRE(node.read(0, out.data(), out.size()) == out.size());
+    REQUIRE(std::count(out.begin(), out.end(), 0) == (long)out.size());
+
+    // a partial write clears the flag and leaves the rest of the chunk zeroed
+    node.buffered_write(CHUNK_SIZE * 3 + 10, "abc", 3);
+    REQUIRE(*node.address_slot(3, false, holder) == INode::address_chunk(first) + 3);
+    REQUIRE(node.delalloc_chunks.empty());
+    char chunk_data[CHUNK_SIZE];
+    node.read(CHUNK_SIZE * 3, chunk_data, CHUNK_SIZE);
+    REQUIRE(std::string(chunk_data + 10, 3) == "abc");
+    REQUIRE(chunk_data[0] == 0);
+    REQUIRE(chunk_data[20] == 0);
+
+    // preallocating again only fills holes, and keep_size leaves the size alone
+    const uint64_t free_mid = sb->disk_block_map->unset_count();
+    node.preallocate(CHUNK_SIZE * 10, CHUNK_SIZE * 15, true);
+    REQUIRE(node.data.file_size == CHUNK_SIZE * 20);
+    REQUIRE(sb->disk_block_map->unset_count() == free_mid - 5);
+}
+
+TEST_CASE( "INode::write handles aligned runs and partial edges", "[filesystem][inode][write]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+
+    INode node;
+    node.superblock = fs->superblock.get();
+
+    std::vector<char> expected(CHUNK_SIZE * 30 + 100, 0);
+    for (size_t i = 0; i < expected.size(); ++i) 
+        expected[i] = (char)(i * 7 + 1);
+
+    SECTION("aligned writes land in one contiguous extent") {
+        REQUIRE(node.write(0, expected.data(), CHUNK_SIZE * 30) == CHUNK_SIZE * 30);
+        REQUIRE(node.data.file_size == CHUNK_SIZE * 30);
+        REQUIRE(node.data.last_modified != 0);
+
+        std::shared_ptr<Chunk> holder;
+        const uint64_t first = *node.address_slot(0, false, holder);
+        for (uint64_t i = 1; i < 30; ++i) 
+            REQUIRE(*node.address_slot(i, false, holder) == first + i);
+        expected.resize(CHUNK_SIZE * 30);
+    }
+
+    SECTION("unaligned writes keep the surrounding bytes") {
+        node.write(0, expected.data(), expected.size());
+        std::vector<char> patch(CHUNK_SIZE * 4, 'x');
+        node.write(CHUNK_SIZE * 2 + 5, patch.data(), patch.size());
+        std::copy(patch.begin(), patch.end(), expected.begin() + CHUNK_SIZE * 2 + 5);
+
+        // a write past the end leaves a zero filled gap
+        node.write(expected.size() + 10, "tail", 4);
+        expected.resize(expected.size() + 10, 0);
+        expected.insert(expected.end(), {'t', 'a', 'i', 'l'});
+    }
+
+    SECTION("writes through chunks that are still buffered") {
+        node.buffered_write(CHUNK_SIZE, "buffered", 8);
+        node.write(0, expected.data(), expected.size());
+        node.flush();
+    }
+
+    std::vector<char> out(expected.size());
+    REQUIRE(node.data.file_size == expected.size());
+    REQUIRE(node.read(0, out.data(), out.size()) == out.size());
+    REQUIRE(out == expected);
+}
+
+TEST_CASE( "INode::write sequential throughput", "[.][benchmark][filesystem][inode]" ) {
+    constexpr uint64_t CHUNK_COUNT = 64 * 1024;
+    constexpr uint64_t CHUNK_SIZE = 4096;
+    constexpr uint64_t WRITE_SIZE = 1024 * 1024;
+    constexpr uint64_t FILE_SIZE = 192 * 1024 * 1024;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.01);
+
+    INode node;
+    node.superblock = fs->superblock.get();
+    std::vector<char> buf(WRITE_SIZE, 'b');
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t offset = 0; offset < FILE_SIZE; offset += WRITE_SIZE) 
+        node.write(offset, buf.data(), buf.size());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "INode::write: " << (FILE_SIZE / elapsed.count()) / (1024 * 1024 * 1024) 
+        << " GiB/s" << std::endl;
+    REQUIRE(node.data.file_size == FILE_SIZE);
+}
+
+TEST_CASE( "INode mapping cache resolves through cached leaves", "[filesystem][inode][mapping]" ) {
+    constexpr uint64_t CHUNK_COUNT = 4096;
+    constexpr uint64_t CHUNK_SIZE = 128;
+    constexpr uint64_t PER_CHUNK = CHUNK_SIZE / sizeof(uint64_t);
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.05);
+
+    INode node;
+    node.superblock = fs->superblock.get();
+
+    // direct chunks, the single indirect leaf and a few double indirect leaves
+    const uint64_t chunk_count = INode::DIRECT_ADDRESS_COUNT + PER_CHUNK * 4;
+    std::vector<char> data(chunk_count * CHUNK_SIZE);
+    for (size_t i = 0; i < data.size(); ++i) 
+        data[i] = (char)(i / CHUNK_SIZE);
+    node.write(0, data.data(), data.size());
+    REQUIRE(node.mapping_cache.size() == 4);
+
+    // a hit hands out the very same slot that a walk would
+    for (uint64_t chunk_number = 0; chunk_number < chunk_count; ++chunk_number) {
+        std::shared_ptr<Chunk> cached_holder;
+        uint64_t *cached = node.address_slot(chunk_number, false, cached_holder);
+        node.drop_mapping_cache();
+        std::shared_ptr<Chunk> walked_holder;
+        uint64_t *walked = node.address_slot(chunk_number, false, walked_holder);
+        REQUIRE(cached == walked);
+    }
+
+    // the cache stays bounded and reads through it stay correct
+    node.drop_mapping_cache();
+    for (uint64_t leaf = 0; leaf < INode::MAPPING_CACHE_LEAVES + 8; ++leaf) {
+        std::shared_ptr<Chunk> holder;
+        node.address_slot(INode::DIRECT_ADDRESS_COUNT + PER_CHUNK * leaf, true, holder);
+    }
+    REQUIRE(node.mapping_cache.size() == INode::MAPPING_CACHE_LEAVES);
+
+    std::vector<char> out(data.size());
+    node.read(0, out.data(), out.size());
+    REQUIRE(out == data);
+}
+
+TEST_CASE( "INode::map_range coalesces physical extents", "[filesystem][inode][mapping]" ) {
+    constexpr uint64_t CHUNK_COUNT = 4096;
+    constexpr uint64_t CHUNK_SIZE = 128;
+    constexpr uint64_t PER_CHUNK = CHUNK_SIZE / sizeof(uint64_t);
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.05);
+
+    INode node;
+    node.superblock = fs->superblock.get();
+
+    // a run across the direct/indirect boundary, a hole, then a preallocated run
+    std::vector<char> data(CHUNK_SIZE * 20, 'd');
+    node.write(0, data.data(), data.size());
+    node.preallocate(CHUNK_SIZE * (PER_CHUNK + 8), CHUNK_SIZE * 4);
+
+    std::vector<INode::ChunkExtent> extents;
+    node.map_range(0, PER_CHUNK + 12, extents);
+
+    std::shared_ptr<Chunk> holder;
+    REQUIRE(extents.size() == 3);
+    REQUIRE(extents[0].logical == 0);
+    REQUIRE(extents[0].count == 20);
+    REQUIRE(extents[0].physical == *node.address_slot(0, false, holder));
+    REQUIRE_FALSE(extents[0].unwritten);
+
+    REQUIRE(extents[1].logical == 20);
+    REQUIRE(extents[1].physical == 0);
+    REQUIRE(extents[1].count == PER_CHUNK + 8 - 20);
+
+    REQUIRE(extents[2].logical == PER_CHUNK + 8);
+    REQUIRE(extents[2].unwritten);
+    REQUIRE(extents[2].count == 4);
+
+    // chunks past the preallocated run are holes again, the walk allocated nothing
+    const uint64_t free_chunks = fs->superblock->disk_block_map->unset_count();
+    node.map_range(PER_CHUNK + 12, PER_CHUNK * 3, extents);
+    REQUIRE(extents.size() == 1);
+    REQUIRE(extents[0].physical == 0);
+    REQUIRE(extents[0].count == PER_CHUNK * 3);
+    REQUIRE(fs->superblock->disk_block_map->unset_count() == free_chunks);
+}
+
+TEST_CASE( "Extent mapped inodes", "[filesystem][inode][extents]" ) {
+    constexpr uint64_t CHUNK_COUNT = 4096;
+    constexpr uint64_t CHUNK_SIZE = 128;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.05);
+    SuperBlock *sb = fs->superblock.get();
+
+    INode node;
+    node.superblock = sb;
+    node.use_extent_mapping();
+
+    SECTION("a contiguous file is a single inline extent") {
+        std::vector<char> data(CHUNK_SIZE * 1000 + 17, 'e');
+        const uint64_t free_chunks = sb->disk_block_map->unset_count();
+        node.write(0, data.data(), data.size());
+        // no indirect chunks are needed, only the data itself
+        REQUIRE(sb->disk_block_map->unset_count() == free_chunks - 1001);
+        REQUIRE(node.extent_map.size() == 1);
+
+        sb->inode_table->set_inode(3, node);
+        REQUIRE(node.data.addresses[INode::EXTENT_COUNT] == 1);
+        REQUIRE(node.data.addresses[INode::EXTENT_TREE_ROOT] == 0);
+
+        std::shared_ptr<INode> loaded = sb->inode_table->get_inode(3);
+        std::vector<char> out(data.size());
+        REQUIRE(loaded->read(0, out.data(), out.size()) == out.size());
+        REQUIRE(out == data);
+    }
+
+    SECTION("fragmented files spill into the extent tree and back") {
+        // every other chunk leaves a hole, so no two extents can merge
+        std::vector<std::vector<char>> chunks;
+        for (uint64_t i = 0; i < 200; ++i) {
+            chunks.push_back(std::vector<char>(CHUNK_SIZE, (char)i));
+            node.write(i * 2 * CHUNK_SIZE, chunks.back().data(), CHUNK_SIZE);
+            // allocate something in between so the file can not stay contiguous
+            sb->allocate_chunk(node.lookup_address(i * 2) + 1);
+        }
+        REQUIRE(node.extent_map.size() == 200);
+        sb->inode_table->set_inode(4, node);
+        REQUIRE(node.data.addresses[INode::EXTENT_TREE_ROOT] != 0);
+
+        std::shared_ptr<INode> loaded_node = sb->inode_table->get_inode(4);
+        INode &loaded = *loaded_node;
+        REQUIRE(loaded.lookup_address(7) == 0);
+        for (uint64_t i = 0; i < 200; ++i) {
+            std::vector<char> out(CHUNK_SIZE);
+            loaded.read(i * 2 * CHUNK_SIZE, out.data(), CHUNK_SIZE);
+            REQUIRE(out == chunks[i]);
+            REQUIRE(loaded.lookup_address(i * 2) == node.lookup_address(i * 2));
+        }
+
+        // collapse the map again by remapping everything onto one run
+        const uint64_t free_chunks = sb->disk_block_map->unset_count();
+        DiskBitMap::BitRange range = sb->allocate_extent(400, 400);
+        loaded.set_addresses(0, range.start_idx, 400);
+        REQUIRE(loaded.extent_map.size() == 1);
+        sb->inode_table->set_inode(4, loaded);
+        REQUIRE(loaded.data.addresses[INode::EXTENT_TREE_ROOT] == 0);
+        // the tree's chunks were handed back
+        REQUIRE(sb->disk_block_map->unset_count() > free_chunks - 400);
+    }
+
+    SECTION("overwriting part of an extent splits it") {
+        node.preallocate(0, CHUNK_SIZE * 10);
+        REQUIRE(node.extent_map.size() == 1);
+        node.write(CHUNK_SIZE * 4, std::string(CHUNK_SIZE * 2, 'w').c_str(), CHUNK_SIZE * 2);
+        REQUIRE(node.extent_map.size() == 3);
+        REQUIRE(node.extent_map[4].count == 2);
+        REQUIRE_FALSE(node.extent_map[4].unwritten);
+        REQUIRE(node.extent_map[6].unwritten);
+    }
+
+    INode indirect;
+    indirect.superblock = sb;
+    indirect.write(0, "x", 1);
+    REQUIRE_THROWS_AS(indirect.use_extent_mapping(), FileSystemException);
+}
+
+TEST_CASE( "Reading holes does not allocate", "[filesystem][inode][holes]" ) {
+    constexpr uint64_t CHUNK_COUNT = 4096;
+    constexpr uint64_t CHUNK_SIZE = 128;
+    constexpr uint64_t PER_CHUNK = CHUNK_SIZE / sizeof(uint64_t);
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.05);
+    SuperBlock *sb = fs->superblock.get();
+
+    INode node;
+    node.superblock = sb;
+    const bool extents = GENERATE(false, true);
+    if (extents) 
+        node.use_extent_mapping();
+
+    // data in a direct chunk and far into the double indirect range only
+    const uint64_t far_chunk = INode::DIRECT_ADDRESS_COUNT + PER_CHUNK + PER_CHUNK * 3 + 5;
+    node.write(CHUNK_SIZE * 2, "near", 4);
+    node.write(CHUNK_SIZE * far_chunk + 1, "far", 3);
+
+    const uint64_t free_chunks = sb->disk_block_map->unset_count();
+    std::vector<char> out(node.data.file_size, 1);
+    REQUIRE(node.read(0, out.data(), out.size()) == out.size());
+    REQUIRE(sb->disk_block_map->unset_count() == free_chunks);
+
+    std::vector<char> expected(out.size(), 0);
+    std::memcpy(expected.data() + CHUNK_SIZE * 2, "near", 4);
+    std::memcpy(expected.data() + CHUNK_SIZE * far_chunk + 1, "far", 3);
+    REQUIRE(out == expected);
+
+    // the holes are still holes afterwards
+    REQUIRE(node.lookup_address(3) == 0);
+    REQUIRE(node.lookup_address(INode::DIRECT_ADDRESS_COUNT + 1) == 0);
+    REQUIRE(node.lookup_address(far_chunk - 1) == 0);
+}
+
+TEST_CASE( "Small files keep their data inline", "[filesystem][inode][inline]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+    SuperBlock *sb = fs->superblock.get();
+    const uint64_t free_chunks = sb->disk_block_map->unset_count();
+
+    INode node;
+    node.superblock = sb;
+    const std::string small = "a small file";
+    node.buffered_write(0, small.data(), small.size());
+    node.write(small.size(), "!", 1);
+    REQUIRE(node.has_inline_data());
+    REQUIRE(node.data.file_size == small.size() + 1);
+    REQUIRE(node.delalloc_chunks.empty());
+    REQUIRE(sb->disk_block_map->unset_count() == free_chunks);
+
+    sb->inode_table->set_inode(2, node);
+    std::shared_ptr<INode> loaded_node = sb->inode_table->get_inode(2);
+    INode &loaded = *loaded_node;
+    char out[INode::INLINE_DATA_SIZE] = {0};
+    REQUIRE(loaded.read(0, out, sizeof(out)) == small.size() + 1);
+    REQUIRE(std::string(out, small.size() + 1) == small + "!");
+
+    SECTION("growing past the address area moves the data to a chunk") {
+        std::vector<char> tail(200, 't');
+        loaded.write(INode::INLINE_DATA_SIZE - 4, tail.data(), tail.size());
+        REQUIRE_FALSE(loaded.has_inline_data());
+        REQUIRE(loaded.lookup_address(0) != 0);
+        REQUIRE(sb->disk_block_map->unset_count() == free_chunks - 1);
+
+        std::vector<char> expected(INode::INLINE_DATA_SIZE - 4 + tail.size(), 0);
+        std::memcpy(expected.data(), (small + "!").data(), small.size() + 1);
+        std::memcpy(expected.data() + INode::INLINE_DATA_SIZE - 4, tail.data(), tail.size());
+        std::vector<char> all(expected.size());
+        REQUIRE(loaded.read(0, all.data(), all.size()) == all.size());
+        REQUIRE(all == expected);
+    }
+
+    SECTION("preallocating moves the data out as well") {
+        loaded.preallocate(0, CHUNK_SIZE * 2);
+        REQUIRE_FALSE(loaded.has_inline_data());
+        char again[32] = {0};
+        loaded.read(0, again, small.size() + 1);
+        REQUIRE(std::string(again) == small + "!");
+    }
+
+    SECTION("read_spans points into the address area") {
+        std::vector<INode::ReadSpan> spans;
+        REQUIRE(loaded.read_spans(2, 100, spans) == small.size() - 1);
+        REQUIRE(spans.size() == 1);
+        REQUIRE(spans[0].chunk == nullptr);
+        REQUIRE(spans[0].offset == 2);
+        REQUIRE(spans[0].data == (const Byte *)loaded.data.addresses + spans[0].offset);
+        REQUIRE(std::string((const char *)spans[0].data, spans[0].length) == small.substr(2) + "!");
+    }
+}
+
+TEST_CASE( "INode::read_spans hands out pinned chunks", "[filesystem][inode][spans]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+
+    INode node;
+    node.superblock = fs->superblock.get();
+
+    std::vector<char> expected(CHUNK_SIZE * 6, 0);
+    for (size_t i = 0; i < CHUNK_SIZE * 2; ++i) 
+        expected[i] = (char)('a' + i % 26);
+    node.write(0, expected.data(), CHUNK_SIZE * 2);
+    // a buffered chunk after a hole
+    node.buffered_write(CHUNK_SIZE * 4, "buffered", 8);
+    std::memcpy(expected.data() + CHUNK_SIZE * 4, "buffered", 8);
+    expected.resize(CHUNK_SIZE * 4 + 8);
+
+    std::vector<INode::ReadSpan> spans;
+    REQUIRE(node.read_spans(100, expected.size(), spans) == expected.size() - 100);
+    REQUIRE(node.delalloc_chunks.empty());
+    REQUIRE(spans.size() == 4);
+
+    // the first span points straight into the cached chunk
+    std::shared_ptr<Chunk> first = disk->get_chunk(node.lookup_address(0));
+    REQUIRE(spans[0].chunk == first);
+    REQUIRE(spans[0].data == first->data.get() + 100);
+    REQUIRE(spans[0].length == CHUNK_SIZE - 100);
+    REQUIRE(spans[2].chunk == nullptr);
+    REQUIRE(spans[2].length == CHUNK_SIZE * 2);
+
+    std::string gathered;
+    for (const INode::ReadSpan &span : spans) 
+        gathered.append((const char *)span.data, span.length);
+    REQUIRE(gathered == std::string(expected.begin() + 100, expected.end()));
+}
+
+TEST_CASE( "Direct I/O reads stay coherent with loaded chunks", "[filesystem][inode][direct]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+
+    INode node;
+    node.superblock = fs->superblock.get();
+    std::vector<char> expected(CHUNK_SIZE * 8 + 40);
+    for (size_t i = 0; i < expected.size(); ++i) 
+        expected[i] = (char)(i * 13);
+    node.write(0, expected.data(), expected.size());
+
+    // a chunk modified in memory but not yet flushed to the disk
+    std::shared_ptr<Chunk> dirty = disk->get_chunk(node.lookup_address(3));
+    std::memset(dirty->data.get(), 'd', CHUNK_SIZE);
+    std::memset(expected.data() + CHUNK_SIZE * 3, 'd', CHUNK_SIZE);
+
+    node.direct_io = true;
+    std::vector<char> out(expected.size() - 10);
+    REQUIRE(node.read(10, out.data(), out.size()) == out.size());
+    REQUIRE(out == std::vector<char>(expected.begin() + 10, expected.end()));
+
+    // direct writes update the loaded chunk in turn
+    std::vector<char> overwrite(CHUNK_SIZE * 2, 'w');
+    node.write(CHUNK_SIZE * 2, overwrite.data(), overwrite.size());
+    REQUIRE(dirty->data[0] == 'w');
+}
+
+TEST_CASE( "Truncate frees chunks past the new end", "[filesystem][inode][truncate]" ) {
+    constexpr uint64_t CHUNK_COUNT = 4096;
+    constexpr uint64_t CHUNK_SIZE = 128;
+    constexpr uint64_t PER_CHUNK = CHUNK_SIZE / sizeof(uint64_t);
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    const AllocatorType allocator = GENERATE(AllocatorType::BITMAP, AllocatorType::BUDDY);
+    fs->superblock->init(0.05, allocator);
+    SuperBlock *sb = fs->superblock.get();
+    const uint64_t free_chunks = sb->disk_block_map->unset_count();
+
+    INode node;
+    node.superblock = sb;
+    const bool extents = GENERATE(false, true);
+    if (extents) 
+        node.use_extent_mapping();
+
+    // reaches into the double indirect range
+    const uint64_t size = CHUNK_SIZE * (INode::DIRECT_ADDRESS_COUNT + PER_CHUNK * 3) + 50;
+    std::vector<char> data(size);
+    for (size_t i = 0; i < size; ++i) 
+        data[i] = (char)(i % 251 + 1);
+    node.write(0, data.data(), data.size());
+    node.buffered_write(size + CHUNK_SIZE * 4, "buffered", 8);
+
+    SECTION("to a partial chunk") {
+        const uint64_t new_size = CHUNK_SIZE * (INode::DIRECT_ADDRESS_COUNT + PER_CHUNK) + 10;
+        node.truncate(new_size);
+        REQUIRE(node.data.file_size == new_size);
+        REQUIRE(node.delalloc_chunks.empty());
+        REQUIRE(node.lookup_address(new_size / CHUNK_SIZE + 1) == 0);
+        REQUIRE(node.lookup_address(new_size / CHUNK_SIZE) != 0);
+        REQUIRE(sb->statfs().free_chunks < free_chunks);
+
+        // growing again shows zeros after the old end
+        node.truncate(new_size + CHUNK_SIZE);
+        std::vector<char> out(new_size + CHUNK_SIZE);
+        node.read(0, out.data(), out.size());
+        std::vector<char> expected(data.begin(), data.begin() + new_size);
+        expected.resize(out.size(), 0);
+        REQUIRE(out == expected);
+    }
+
+    SECTION("to nothing") {
+        node.truncate(0);
+        sb->inode_table->set_inode(1, node);
+        REQUIRE(sb->disk_block_map->unset_count() == free_chunks);
+        REQUIRE(sb->statfs().free_chunks == free_chunks);
+        if (allocator == AllocatorType::BITMAP) 
+            REQUIRE(sb->allocation_groups[0]->free_extents.free_count() == free_chunks);
+    }
+}
+
+TEST_CASE( "Freeing an inode frees its chunks, optionally in the background", "[filesystem][inode][truncate]" ) {
+    constexpr uint64_t CHUNK_COUNT = 4096;
+    constexpr uint64_t CHUNK_SIZE = 128;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.05);
+    SuperBlock *sb = fs->superblock.get();
+    const FileSystemStats before = sb->statfs();
+
+    std::vector<char> data(CHUNK_SIZE * 300, 'u');
+    for (uint64_t idx = 0; idx < 4; ++idx) {
+        INode node;
+        node.superblock = sb;
+        if (idx % 2) 
+            node.use_extent_mapping();
+        node.write(0, data.data(), data.size());
+        sb->inode_table->set_inode(idx, node);
+    }
+    REQUIRE(sb->statfs().free_chunks < before.free_chunks - 1200);
+
+    const bool defer = GENERATE(false, true);
+    for (uint64_t idx = 0; idx < 4; ++idx) 
+        sb->inode_table->free_inode(idx, defer);
+    REQUIRE(sb->statfs().free_inodes == before.free_inodes);
+    REQUIRE_THROWS_AS(sb->inode_table->get_inode(0), FileSystemException);
+
+    sb->inode_table->drain_reclaimer();
+    REQUIRE(sb->statfs().free_chunks == before.free_chunks);
+}
+
+TEST_CASE( "INodeTable caches inodes and writes dirty ones back", "[filesystem][inode][cache]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->init(0.1);
+        INodeTable *table = fs->superblock->inode_table.get();
+
+        INode empty;
+        table->set_inode(7, empty);
+        table->set_inode(8, empty);
+
+        std::shared_ptr<INode> a = table->get_inode(7);
+        REQUIRE(a == table->get_inode(7));
+        REQUIRE(a->table == table);
+        REQUIRE(a->idx == 7);
+
+        a->write(0, "cached", 6);
+        REQUIRE(a->dirty);
+        table->sync_inodes();
+        REQUIRE_FALSE(a->dirty);
+
+        // changes made through the cache reach the disk without set_inode
+        table->get_inode(8)->write(0, "written back", 12);
+        a->write(6, "!", 1);
+
+        // a hot inode takes up a single slot of the recently used ring
+        for (uint64_t i = 0; i < INodeTable::RECENT_INODES * 2; ++i) 
+            table->get_inode(7);
+        REQUIRE(std::count(table->recent_inodes.begin(), table->recent_inodes.end(), a) == 1);
+        REQUIRE(table->recent_inodes.size() == 2);
+    }
+
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->load_from_disk(disk.get());
+    char out[16] = {0};
+    REQUIRE(fs->superblock->inode_table->get_inode(7)->read(0, out, sizeof(out)) == 7);
+    REQUIRE(std::string(out) == "cached!");
+    REQUIRE(fs->superblock->inode_table->get_inode(8)->data.file_size == 12);
+}
+
+TEST_CASE( "Writing inodes back flushes their buffered chunks", "[filesystem][inode][cache][delalloc]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::vector<char> data(2000);
+    for (size_t i = 0; i < data.size(); ++i) 
+        data[i] = (char)(i * 13 + 1);
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->init(0.1);
+        INodeTable *table = fs->superblock->inode_table.get();
+        REQUIRE(table->allocate_inode() == 0);
+        REQUIRE(table->allocate_inode() == 1);
+        table->get_inode(0)->buffered_write(0, data.data(), data.size());
+        fs->superblock->sync();
+        REQUIRE(table->get_inode(0)->delalloc_chunks.empty());
+        REQUIRE(fs->superblock->reserved_chunks == 0);
+
+        // and so does write back when the last reference goes
+        table->recent_inodes.clear();
+        table->get_inode(1)->buffered_write(0, data.data(), data.size());
+        table->recent_inodes.clear();
+        REQUIRE(fs->superblock->reserved_chunks == 0);
+    }
+
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->load_from_disk(disk.get());
+    for (uint64_t idx = 0; idx < 2; ++idx) {
+        std::vector<char> out(data.size());
+        REQUIRE(fs->superblock->inode_table->get_inode(idx)->read(0, out.data(), out.size()) == out.size());
+        REQUIRE(out == data);
+    }
+}
+
+TEST_CASE( "Inodes that can not be written back stay dirty", "[filesystem][inode][cache]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.1);
+    SuperBlock *sb = fs->superblock.get();
+    INodeTable *table = sb->inode_table.get();
+    REQUIRE(table->allocate_inode() == 0);
+
+    // more extents than fit in the inode, storing them needs a tree chunk
+    std::vector<uint64_t> physical;
+    {
+        std::shared_ptr<INode> node = table->get_inode(0);
+        node->use_extent_mapping();
+        for (uint64_t i = 0; i < 8; ++i) {
+            physical.push_back(sb->allocate_chunk()->chunk_idx);
+            node->set_addresses(i * 2, physical.back(), 1);
+        }
+        node->data.file_size = 16 * CHUNK_SIZE;
+    }
+    std::vector<uint64_t> filler;
+    while (sb->disk_block_map->unset_count() > 0) 
+        filler.push_back(sb->allocate_chunk()->chunk_idx);
+
+    table->recent_inodes.clear();
+    REQUIRE(table->writeback_failed.size() == 1);
+    REQUIRE_THROWS_AS(table->sync_inodes(), FileSystemException);
+
+    // the inode is handed out again with its changes
+    REQUIRE(table->get_inode(0)->lookup_address(14) == physical[7]);
+    table->recent_inodes.clear();
+
+    sb->free_chunk(filler.back());
+    table->sync_inodes();
+    REQUIRE(table->writeback_failed.empty());
+    table->recent_inodes.clear();
+    std::shared_ptr<INode> node = table->get_inode(0);
+    REQUIRE_FALSE(node->dirty);
+    for (uint64_t i = 0; i < 8; ++i) 
+        REQUIRE(node->lookup_address(i * 2) == physical[i]);
+}
+
+TEST_CASE( "INodeTable::allocate_inode", "[filesystem][inode][allocate]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.02);
+    INodeTable *table = fs->superblock->inode_table.get();
+    const uint64_t per_chunk = table->inodes_per_chunk;
+
+    SECTION("hands out every inode exactly once") {
+        std::set<uint64_t> seen;
+        for (uint64_t i = 0; i < table->size_inodes(); ++i) {
+            const uint64_t idx = table->allocate_inode();
+            REQUIRE(seen.insert(idx).second);
+            REQUIRE(table->get_inode(idx)->data.file_size == 0);
+        }
+        // a full table grows
+        const uint64_t table_inodes = table->size_inodes();
+        REQUIRE(table->allocate_inode() == table_inodes);
+        REQUIRE(table->size_inodes() == table_inodes + table->inodes_per_extension);
+
+        // freed inodes are found again from the rotating cursor
+        table->free_inode(3);
+        table->free_inode(table_inodes - 1);
+        std::set<uint64_t> again = {table->allocate_inode(), table->allocate_inode()};
+        REQUIRE(again == std::set<uint64_t>({3, table_inodes - 1}));
+    }
+
+    SECTION("prefers the parent's inode table chunk") {
+        for (uint64_t i = 0; i < per_chunk * 2; ++i) 
+            table->allocate_inode();
+        table->free_inode(per_chunk + 2);
+        table->free_inode(1);
+
+        // the cursor would hand out 1 next, the parent's chunk wins
+        REQUIRE(table->allocate_inode(per_chunk + 3) == per_chunk + 2);
+        // a full parent chunk falls back to the cursor
+        REQUIRE(table->allocate_inode(per_chunk + 3) == 1);
+    }
+}
+
+TEST_CASE( "Batched inode updates", "[filesystem][inode][batch]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.05);
+    INodeTable *table = fs->superblock->inode_table.get();
+
+    // out of order and spread over several inode table chunks
+    std::vector<INode> nodes(20);
+    std::vector<std::pair<uint64_t, INode *>> records;
+    for (uint64_t i = 0; i < nodes.size(); ++i) {
+        nodes[i].data.UID = 100 + i;
+        records.push_back(std::make_pair((i * 7) % nodes.size(), &nodes[i]));
+    }
+    table->set_inodes(records);
+
+    for (uint64_t i = 0; i < nodes.size(); ++i) 
+        REQUIRE(table->get_inode((i * 7) % nodes.size())->data.UID == 100 + i);
+
+    // changes to cached inodes are combined on sync
+    for (uint64_t idx = 0; idx < nodes.size(); ++idx) {
+        std::shared_ptr<INode> node = table->get_inode(idx);
+        node->data.last_modified = 1234;
+        node->mark_dirty();
+    }
+    table->sync_inodes();
+    for (uint64_t idx = 0; idx < nodes.size(); ++idx) {
+        INode::INodeData record;
+        std::shared_ptr<Chunk> chunk = disk->get_chunk(table->inode_ilist_offset + idx / table->inodes_per_chunk);
+        record.decode(chunk->data.get() + INode::INodeData::RECORD_SIZE * (idx % table->inodes_per_chunk));
+        REQUIRE(record.last_modified == 1234);
+        REQUIRE_FALSE(table->get_inode(idx)->dirty);
+    }
+}
+
+TEST_CASE( "The inode table is initialized lazily", "[filesystem][inode][lazyinit]" ) {
+    constexpr uint64_t CHUNK_COUNT = 4096;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    // formatting must not depend on the disk starting out zeroed
+    for (uint64_t idx = 0; idx < CHUNK_COUNT; ++idx) {
+        std::shared_ptr<Chunk> chunk = disk->get_chunk(idx);
+        std::memset(chunk->data.get(), 0xFF, CHUNK_SIZE);
+    }
+
+    FileSystemStats before;
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->init(0.5);
+        INodeTable *table = fs->superblock->inode_table.get();
+        REQUIRE(table->size_inodes() > table->inodes_per_group);
+        REQUIRE(table->initialized_inodes() == 0);
+        REQUIRE(fs->superblock->statfs().free_inodes == table->size_inodes());
+
+        REQUIRE(table->allocate_inode() == 0);
+        REQUIRE(table->allocate_inode() == 1);
+        REQUIRE(table->initialized_inodes() == table->inodes_per_group);
+        REQUIRE_THROWS_AS(table->get_inode(2), FileSystemException);
+        REQUIRE_THROWS_AS(table->get_inode(table->size_inodes() - 1), FileSystemException);
+
+        // the records of an initialized group no longer hold what was on the disk, 
+        // and a freed inode's record is cleared
+        auto record_of = [&](uint64_t idx) {
+            INode::INodeData record;
+            std::shared_ptr<Chunk> chunk = disk->get_chunk(table->inode_ilist_offset + idx / table->inodes_per_chunk);
+            record.decode(chunk->data.get() + INode::INodeData::RECORD_SIZE * (idx % table->inodes_per_chunk));
+            return record;
+        };
+        REQUIRE(record_of(table->inodes_per_group - 1).file_size == 0);
+        table->get_inode(1)->data.UID = 9;
+        table->set_inode(1, *table->get_inode(1));
+        REQUIRE(record_of(1).UID == 9);
+        table->free_inode(1);
+        REQUIRE(record_of(1).UID == 0);
+        REQUIRE(table->allocate_inode() == 1);
+        REQUIRE(table->get_inode(1)->data.UID == 0);
+
+        // writing an inode far into the table initializes the groups before it
+        INode node;
+        node.data.UID = 7;
+        table->set_inode(table->size_inodes() - 1, node);
+        REQUIRE(table->initialized_inodes() == table->size_inodes());
+        REQUIRE(table->get_inode(table->size_inodes() - 1)->data.UID == 7);
+        REQUIRE_THROWS_AS(table->get_inode(table->inodes_per_group), FileSystemException);
+        before = fs->superblock->statfs();
+        REQUIRE(before.free_inodes == table->size_inodes() - 3);
+    }
+
+    {
+        // recount after an unclean unmount
+        auto sb_chunk = disk->get_chunk(0);
+        ((uint64_t *)sb_chunk->data.get())[12] = 0;
+    }
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->load_from_disk(disk.get());
+    REQUIRE(fs->superblock->statfs().free_inodes == before.free_inodes);
+    REQUIRE(fs->superblock->inode_table->allocate_inode() == 2);
+}
+
+TEST_CASE( "The inode table grows into the data area", "[filesystem][inode][grow]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    FileSystemStats before;
+    uint64_t last = 0;
+    {
+        std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+        fs->superblock->init(0.01);
+        SuperBlock *sb = fs->superblock.get();
+        INodeTable *table = sb->inode_table.get();
+        const uint64_t table_inodes = table->size_inodes();
+        const uint64_t free_chunks = sb->statfs().free_chunks;
+
+        for (uint64_t i = 0; i < table_inodes + table->inodes_per_extension + 1; ++i) 
+            last = table->allocate_inode();
+        REQUIRE(table->extension_count == 2);
+        REQUIRE(sb->statfs().free_chunks == free_chunks - 2 * INodeTable::EXTENSION_CHUNKS);
+        REQUIRE(sb->statfs().free_inodes == table->inodes_per_extension - 1);
+
+        // inodes in an extension behave like any other
+        std::shared_ptr<INode> node = table->get_inode(last);
+        node->data.UID = 42;
+        node->write(0, "extended", 8);
+        node->mark_dirty();
+
+        // and the parent's chunk is preferred there as well
+        table->free_inode(table_inodes + 1);
+        REQUIRE(table->allocate_inode(table_inodes + 2) == table_inodes + 1);
+        before = sb->statfs();
+    }
+
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->load_from_disk(disk.get());
+    INodeTable *table = fs->superblock->inode_table.get();
+    REQUIRE(table->extension_count == 2);
+    REQUIRE(fs->superblock->statfs().free_inodes == before.free_inodes);
+    REQUIRE(fs->superblock->statfs().free_chunks == before.free_chunks);
+
+    std::shared_ptr<INode> node = table->get_inode(last);
+    char out[8] = {0};
+    REQUIRE(node->data.UID == 42);
+    REQUIRE(node->read(0, out, sizeof(out)) == sizeof(out));
+    REQUIRE(std::string(out, sizeof(out)) == "extended");
+    REQUIRE(table->allocate_inode() == last + 1);
+}
+
+TEST_CASE( "The inode table can not grow on a fragmented disk", "[filesystem][inode][grow]" ) {
+    constexpr uint64_t CHUNK_COUNT = 1024;
+    constexpr uint64_t CHUNK_SIZE = 512;
+
+    std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+    std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+    fs->superblock->init(0.01);
+    SuperBlock *sb = fs->superblock.get();
+    INodeTable *table = sb->inode_table.get();
+    for (uint64_t i = 0; i < table->size_inodes(); ++i) 
+        table->allocate_inode();
+
+    // every other chunk is used, half the data area is free but no run of 64 is
+    std::vector<uint64_t> chunks;
+    while (sb->disk_block_map->unset_count() > 0) 
+        chunks.push_back(sb->allocate_chunk()->chunk_idx);
+    for (size_t i = 0; i < chunks.size(); i += 2) 
+        sb->free_chunk(chunks[i]);
+    REQUIRE(sb->statfs().free_chunks > INodeTable::EXTENSION_CHUNKS);
+
+    try {
+        table->allocate_inode();
+        FAIL("the table grew");
+    } catch (const FileSystemException &e) {
+        REQUIRE(e.message.find("out of space") != std::string::npos);
+    }
+    REQUIRE(table->extension_count == 0);
+}
+
+TEST_CASE( "INode records have a fixed on-disk layout", "[filesystem][inode][record]" ) {
+    INode::INodeData data;
+    data.file_size = 0x0102030405060708ull;
+    data.last_modified = 1234;
+    data.UID = 42;
+    data.reference_count = 3;
+    data.inode_bits.set(0);
+    data.inode_bits.set(INode::INLINE_DATA_BIT);
+    for (uint64_t i = 0; i < INode::ADDRESS_COUNT; ++i) 
+        data.addresses[i] = 100 + i;
+
+    std::vector<Byte> record(INode::INodeData::RECORD_SIZE, 0xAB);
+    data.encode(record.data());
+
+    // the fields stat reads are at fixed offsets at the front of the record
+    uint64_t word = 0;
+    std::memcpy(&word, record.data() + INode::INodeData::RECORD_FILE_SIZE, sizeof(word));
+    REQUIRE(word == data.file_size);
+    std::memcpy(&word, record.data() + INode::INodeData::RECORD_UID, sizeof(word));
+    REQUIRE(word == 42);
+    uint32_t bits = 0;
+    std::memcpy(&bits, record.data() + INode::INodeData::RECORD_INODE_BITS, sizeof(bits));
+    REQUIRE(bits == ((1u << INode::INLINE_DATA_BIT) | 1u));
+    std::memcpy(&bits, record.data() + INode::INodeData::RECORD_INODE_BITS + 4, sizeof(bits));
+    REQUIRE(bits == 0);
+    std::memcpy(&word, record.data() + INode::INodeData::RECORD_SIZE - sizeof(word), sizeof(word));
+    REQUIRE(word == 100 + INode::ADDRESS_COUNT - 1);
+
+    INode::INodeData decoded;
+    decoded.decode(record.data());
+    REQUIRE(decoded.file_size == data.file_size);
+    REQUIRE(decoded.last_modified == 1234);
+    REQUIRE(decoded.UID == 42);
+    REQUIRE(decoded.reference_count == 3);
+    REQUIRE(decoded.inode_bits == data.inode_bits);
+    REQUIRE(std::equal(data.addresses, data.addresses + INode::ADDRESS_COUNT, decoded.addresses));
+}